@@ -9,6 +9,10 @@ struct editor_syntax {
    char * multiline_comment_start;
    char * multiline_comment_end;
    int flags;
+   // characters that open and close a string, "\"'" when NULL
+   char * string_delimiters;
+   // built from the fields above the first time the syntax is selected
+   struct syntax_lexer * lexer;
 };
 
 // === C/CPP ===
@@ -35,20 +39,24 @@ char * PY_HL_keywords[] = {
 };
 
 // HIGHLIGHT DATABASE
+// built in languages. more are read from *.syntax files at runtime, see
+// the examples in syntax/ for the format
 struct editor_syntax HLDB[] = {
    {
       "c",
       C_HL_extensions,
       C_HL_keywords,
       "//", "/*", "*/",
-      HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS
+      HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS,
+      NULL, NULL
    },
    {
       "python",
       PY_HL_extensions,
       PY_HL_keywords,
       "#", "\"\"\"", "\"\"\"",
-      HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS
+      HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS,
+      NULL, NULL
    }
 };
 
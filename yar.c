@@ -3,22 +3,36 @@
 #define _GNU_SOURCE
 
 #include <ctype.h>
+#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <locale.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stddef.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <termios.h>
 #include <time.h>
 #include <unistd.h>
+#include <wchar.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "syntax.c"
 
 #define CTRL_KEY(k) ((k) & 0x1f)
-#define ABUF_INIT {NULL, 0}
+#define ABUF_INIT {NULL, 0, 0}
 #define YAR_VERSION "0.3"
 #define YAR_QUIT_TIMES 1
 #define YAR_WELCOME_LINE_COUNT (int)(sizeof(YAR_WELCOME)/sizeof(YAR_WELCOME[0]))
@@ -43,16 +57,403 @@ char YAR_WELCOME[10][80] = {
 #define MODE_EDITING 1
 #define MODE_COMMAND 2
 
+// max rows per leaf / children per inner node of the row tree
+#define ROW_NODE_MAX 64
+// smallest gap opened up when a row runs out of room
+#define ROW_GAP_MIN 16
+// files are split into chunks of at least this many bytes for indexing
+#define LINE_CHUNK_MIN (8 << 20)
+#define LINE_CHUNK_THREADS 64
+// rows per thread below which the first highlight pass isn't split up
+#define HL_CHUNK_MIN 16384
+#define HL_CHUNK_THREADS 64
+// rows checked per idle tick past the last highlighted row
+#define HL_IDLE_ROWS 4096
+// rendered rows kept around for drawing and searching
+#define RENDER_CACHE_ROWS 512
+// input read in one go, and how long the rest of an escape sequence is
+// waited for
+#define INPUT_BUF_SIZE 65536
+#define ESC_TIMEOUT_MS 100
+// how long a paste that stops coming is waited on for its end marker,
+// which a slow link can hold up for much longer than a key's sequence
+#define PASTE_TIMEOUT_MS 5000
+// bracketed paste: the terminal wraps pasted text in \x1b[200~ and PASTE_END
+#define PASTE_MODE_ON "\x1b[?2004h"
+#define PASTE_MODE_OFF "\x1b[?2004l"
+#define PASTE_END "\x1b[201~"
+// mouse reports for presses and the wheel, in the SGR format
+// "\x1b[<button;x;yM" (m on release)
+#define MOUSE_MODE_ON "\x1b[?1000h\x1b[?1006h"
+#define MOUSE_MODE_OFF "\x1b[?1006l\x1b[?1000l"
+#define MOUSE_REPORT_MAX 32
+#define WHEEL_ROWS 3
+// pieces handed to one writev() when saving, and how often a save that's
+// syncing in the background is checked on
+#define SAVE_IOV (IOV_MAX < 1024 ? IOV_MAX : 1024)
+#define SAVE_POLL_MS 50
+// how long edits sit in memory before they're appended to the journal
+#define JOURNAL_FLUSH_MS 1000
+#define JOURNAL_MAGIC "YARJ1\n"
+// the length of a 'c' record is a varint padded out to this many bytes
+#define JOURNAL_RUN_LEN 5
+// rows (or matches, when narrowing) in one piece of a search, and how
+// often the matches workers have found are picked up
+#define SEARCH_CHUNK_ROWS 32768
+#define SEARCH_POLL_MS 30
+// a literal search of a buffer no bigger than this is done right away,
+// on the main thread
+#define SEARCH_INLINE_MAX (1 << 20)
+// how much of a lazy leaf's block a worker searches before it looks to
+// see whether it's been called off
+#define SEARCH_SLICE (1 << 20)
+// rows longer than this aren't searched on the main thread to highlight
+// them; they take their matches from what the workers found
+#define SEARCH_HL_ROW_MAX (64 << 10)
+// states (and bytes) a regex dfa holds before it starts over, and how
+// deep a pattern's groups can nest
+#define REGEX_DFA_STATES 32768
+#define REGEX_DFA_MEM (8 << 20)
+#define REGEX_DEPTH_MAX 64
+// bytes, past a line's length, its runs to the longest match may go over
+// again before the line is left to the nfa
+#define REGEX_RERUN_MAX 4096
+// pause between idle highlighting steps, and how many timers can be set
+#define IDLE_TICK_MS 100
+#define EDITOR_TIMERS 4
+
+/* chars is a gap buffer: the text is chars[0, gap) followed by
+ * chars[gap + gaplen, size + gaplen), so a run of edits at one spot only
+ * moves bytes when the cursor jumps. hl_start/hl_open_comment are the
+ * comment state at the start and end of the row as of its last highlight,
+ * which tells whether a row needs redoing when the rows above change.
+ * stale rows were edited since then. rows don't keep their rendered text,
+ * see struct row_render. */
 typedef struct erow {
-   int idx;
    int size;
-   int rsize;
+   int gap;
+   int gaplen;
    char * chars;
-   char * render;
-   unsigned char * hl;
+   int hl_start;
    int hl_open_comment;
+   int stale;
+   int rslot;
+   unsigned long rtag;
+   struct row_node * leaf;
 } erow;
 
+/* a row with its tabs expanded, and the highlighting of that. only rows
+ * that are drawn or searched keep theirs, in E.rcache; everything else is
+ * rendered into a scratch buffer just long enough to learn its comment
+ * state. buffers keep their allocation from one row to the next */
+struct row_render {
+   char * render;
+   int rsize;
+   int rcap;
+   unsigned char * hl;
+   int hlcap;
+};
+
+/* the render cache. a row owns entry rslot while the entry's tag is still
+ * its rtag, so rows can move around the tree and entries can be handed to
+ * other rows without either side fixing the other up. entries rendered
+ * before the last settings change (an older gen), or highlighted from a
+ * different comment state, are rebuilt in place when next used. the
+ * entries form a list from most to least recently used */
+struct render_entry {
+   struct row_render r;
+   unsigned long tag;
+   unsigned int gen;
+   int hl_start;
+   int prev, next;
+   // where the search query is in r, as [from, to) pairs of rendered
+   // columns. found for search generation match_gen, and found again
+   // when r is rebuilt (the row was edited) or the query changes
+   int * spans;
+   int nspans, spancap;
+   unsigned int match_gen;
+};
+
+/* rows live in a counted B+ tree. leaves hold the erows themselves and
+ * inner nodes remember how many rows sit below each child, so finding,
+ * inserting and deleting row N are all O(log n). a row's index is never
+ * stored, it comes from its position in the tree.
+ *
+ * a file opened through mmap starts out as lazy leaves that only hold the
+ * offsets of their lines in the map (line i is offs[i] up to offs[i + 1]).
+ * a lazy leaf is turned into real rows the first time one of them is
+ * looked up.
+ *
+ * bytes is how long the rows below a node are when saved, kept while
+ * bytes_ok. edits and moves clear bytes_ok up to the root, and totals are
+ * summed again the next time they're asked for, so after an edit only
+ * the nodes along its path are summed again. */
+struct row_node {
+   struct row_node * parent;
+   int leaf;
+   int lazy;
+   int n;
+   long long bytes;
+   int bytes_ok;
+   // a lazy leaf that's been highlighted keeps just its comment states
+   int hl_done;
+   int hl_start, hl_open_comment;
+   union {
+      struct {
+         int counts[ROW_NODE_MAX];
+         struct row_node * child[ROW_NODE_MAX];
+      } in;
+      // ROW_NODE_MAX rows, allocated apart so lazy leaves stay small
+      erow * rows;
+      off_t offs[ROW_NODE_MAX + 1];
+   } u;
+};
+
+/* frames are drawn into a grid of cells, one per screen column, and only
+ * the cells that differ from the last frame sent (E.shadow) are written
+ * to the terminal. a cell holds one UTF-8 character; attr is the SGR
+ * foreground colour (0 for the default) plus ATTR_REVERSE. a character
+ * two columns wide is followed by a cell with len 0 for its second one */
+#define ATTR_REVERSE 0x80
+
+struct screen_cell {
+   char glyph[4];
+   unsigned char len;
+   unsigned char attr;
+};
+
+/* a growable output buffer. E.out is used for every frame and keeps its
+ * capacity, so once it has grown to fit a frame drawing one allocates
+ * nothing */
+struct abuf {
+   char *b;
+   int len;
+   int cap;
+};
+
+/* the last mouse report: rows the wheel scrolled by (summed over the
+ * reports that came in together), or a click at x, y */
+struct editor_mouse {
+   int scroll;
+   int click;
+   int x, y;
+};
+
+/* a save being synced to disk in the background: the thread fsyncs the
+ * file and, for a temp file, the journal (so its 'N' record is there
+ * first) before renaming it over the target and syncing the directory,
+ * then sets done. err is the errno it failed with, if it did */
+struct save_job {
+   pthread_t thread;
+   int active;
+   int fd;
+   int journal_fd;
+   char * tmp;
+   char * target;
+   // where the journal ended when the save started
+   long long journaled;
+   int err;
+   int done;
+};
+
+/* the edit journal: every edit since the file was last saved, appended
+ * to .<name>.yar-journal next to it, so the edits can be replayed over
+ * the file if the editor goes away before saving. records are an op
+ * byte, then the row, a column and a length as varints, then that many
+ * bytes. they're kept in buf and written out on a timer, and inserts of
+ * characters typed one after another are merged into one record while
+ * still in buf. the header holds the size and mtime of the file the
+ * edits apply to. a save that rewrites the file in place first adds a
+ * 'W' record holding everything it's about to write */
+struct edit_journal {
+   int on;
+   int fd;
+   char * path;
+   long long base_size;
+   long long base_sec, base_nsec;
+   struct abuf buf;
+   int last;
+   int last_row, last_col, last_len;
+};
+
+/* a regex is compiled to a program for a thompson nfa: CLASS steps over
+ * a byte in class cls, SPLIT carries on at both x and y, JMP at x, BOL
+ * and EOL only at the start and end of the line. everything else goes on
+ * to the next instruction */
+enum regex_op {
+   RE_CLASS,
+   RE_SPLIT,
+   RE_JMP,
+   RE_BOL,
+   RE_EOL,
+   RE_MATCH
+};
+
+struct regex_inst {
+   int op;
+   int x, y;
+   int cls;
+};
+
+struct regex_prog {
+   struct regex_inst * inst;
+   int n;
+};
+
+/* the pattern forwards, and backwards for finding where matches start.
+ * classes are bitsets of the bytes they take. bytes no class tells apart
+ * share a group in groups, so dfas step on ngroups kinds of byte */
+struct regex {
+   struct regex_prog fwd, rev;
+   unsigned char (*classes)[32];
+   int nclasses;
+   unsigned char groups[256];
+   int ngroups;
+};
+
+/* a state of a dfa is the set of nfa instructions the text so far leaves
+ * threads at. match is whether one's at MATCH, match_eol whether one
+ * would be if the line ended here. next, by byte group, is built a step
+ * at a time */
+struct dfa_state {
+   int * pcs;
+   int n;
+   int match, match_eol;
+   int * next;
+};
+
+/* a dfa over prog, built lazily as text runs through it. an unanchored
+ * one starts a thread at every byte, not just the first. once it holds
+ * REGEX_DFA_STATES states, or REGEX_DFA_MEM bytes of them, they're all
+ * thrown away and built again, so a pattern whose dfa would blow up
+ * costs time, never unbounded memory */
+struct regex_dfa {
+   struct regex * re;
+   struct regex_prog * prog;
+   int anchored;
+   struct dfa_state * states;
+   int nstates;
+   size_t mem;
+   int * table;
+   int start[2];
+   int clears;
+   unsigned char * mark;
+   int * stack;
+   int * set;
+};
+
+/* a thread of the reversed pattern, and where the match it's part of
+ * ends */
+struct regex_thread {
+   int pc;
+   int end;
+};
+
+/* the reversed pattern's threads run side by side backwards over a line,
+ * for lines where running a dfa from each start would go over the same
+ * bytes too many times. seen marks the instructions gone through for the
+ * step numbered gen, and longest[p] is where the longest match from p
+ * ends, or -1 */
+struct regex_nfa {
+   struct regex_prog * prog;
+   struct regex_thread * list[2];
+   int n[2];
+   int * seen;
+   int gen;
+   int * stack;
+   int * longest;
+   int longest_cap;
+};
+
+/* what one thread needs to find matches of a regex: find says whether a
+ * line has any, starts (run backwards) where they can start, and longest
+ * how far each goes, or nfa when that would take too long */
+struct regex_matcher {
+   struct regex_dfa find, starts, longest;
+   struct regex_nfa nfa;
+   // empty matches count too (not right where one ends), and one stops
+   // at the first, for :s
+   int empty, one;
+   int * cancel;
+   char * starts_at;
+   char * text;
+   int starts_cap, text_cap;
+};
+
+/* one occurrence of the search query: len bytes at column col of row */
+struct search_match {
+   int row, col;
+   int len;
+};
+
+/* a piece of a search handed to a worker: rows [from, to) of the buffer,
+ * or when narrowing, matches [from, to) of the last query. done is set
+ * once found holds everything the piece has */
+struct search_chunk {
+   int from, to;
+   struct search_match * found;
+   int nfound, cap;
+   int done;
+};
+
+/* a long row matched on a worker after the search is kept, when there's
+ * no index of matches to take its own from. the worker has a copy of the
+ * row's text, so edits needn't wait for it; what it finds goes to the
+ * render entry slot while that still has tag, i.e. the row wasn't edited */
+struct search_row_job {
+   pthread_t thread;
+   int active;
+   int slot;
+   unsigned long tag;
+   char * text;
+   int len;
+   struct search_chunk found;
+   int done;
+   int cancel;
+};
+
+/* incremental search. matches holds every occurrence of the query found
+ * so far, in order; chunks are merged into it in order as workers finish
+ * them, so it only ever grows at the end. a query that extends the last
+ * one can only occur where the last one did, so typing narrows matches
+ * down instead of searching the buffer again.
+ *
+ * the query stays highlighted wherever it's on screen, after the search
+ * too (kept, once matches are let go of, with long rows matched by
+ * row_job). gen changes with the query, and rows drawn find theirs again
+ * when it does */
+struct search_state {
+   char * query;
+   int qlen;
+   // the query compiled, in regex mode, or why it didn't compile
+   struct regex * re;
+   const char * error;
+   struct search_match * matches;
+   int nmatches, cap;
+   int current;
+   int kept;
+   unsigned int gen;
+   // for finding the matches of one row, on the main thread
+   struct regex_matcher matcher;
+   struct search_chunk row_found;
+   // the scan: prev is what's being narrowed (NULL for a full scan)
+   struct search_match * prev;
+   struct search_chunk * chunks;
+   int nchunks, merged;
+   int next_chunk;
+   int cancel;
+   int running;
+   pthread_t * threads;
+   int nthreads;
+   struct search_row_job row_job;
+};
+
+/* a timer runs fn once, at due (on the clock of editor_now_ms()) */
+struct editor_timer {
+   long long due;
+   void (*fn)();
+};
+
 struct EditorConfig {
    int cx, cy;
    int rx;
@@ -61,7 +462,55 @@ struct EditorConfig {
    int screenrows;
    int screencols;
    int numrows;
-   erow * row;
+   struct row_node * rows;
+   char * map;
+   size_t map_len;
+   int hl_valid;
+   // rows from save_from on may differ from the file on disk, which is
+   // known to hold the rows before it if disk_known. disk is its stat
+   // from the last save (or open), map_dev/map_ino the file E.map is of
+   int save_from;
+   int disk_known;
+   struct stat disk;
+   dev_t map_dev;
+   ino_t map_ino;
+   struct render_entry * rcache;
+   int rcache_head, rcache_tail;
+   unsigned long rcache_tags;
+   unsigned int render_gen;
+   struct screen_cell * frame;
+   struct screen_cell * shadow;
+   // per row of the grids, whether it holds characters whose width isn't
+   // known to be one or two columns
+   unsigned char * frame_odd;
+   unsigned char * shadow_odd;
+   // a UTF-8 ctype for asking character widths in
+   locale_t utf8;
+   int frame_rows, frame_cols;
+   int shadow_valid;
+   int shadow_rowoff;
+   int term_x, term_y;
+   struct abuf out;
+   int out_fd;
+   int out_sent;
+   int redraw_pending;
+   char in[INPUT_BUF_SIZE];
+   int in_len, in_pos;
+   struct editor_timer timers[EDITOR_TIMERS];
+   struct editor_mouse mouse;
+   struct save_job save;
+   int save_fsync;
+   int search_regex;
+   struct edit_journal journal;
+   struct search_state search;
+   // taken for writing while a lazy leaf's offsets become rows, for
+   // reading by search workers walking the tree
+   pthread_rwlock_t leaf_lock;
+   volatile sig_atomic_t hangup;
+   // set when the mapped file shrank under a read of it. page_size is
+   // looked up ahead since the handler can't
+   volatile sig_atomic_t map_lost;
+   long page_size;
    int mode;
    int mode_previous;
    int dirty;
@@ -69,6 +518,9 @@ struct EditorConfig {
    char statusmsg[80];
    time_t statusmsg_time;
    struct editor_syntax * syntax;
+   struct editor_syntax ** syntaxes;
+   int num_syntaxes;
+   int syntaxes_loaded;
    struct termios orig_termios;
 
    int tab_stop;
@@ -76,11 +528,6 @@ struct EditorConfig {
    int tabs_as_spaces;
 };
 
-struct abuf {
-   char *b;
-   int len;
-};
-
 enum editor_key {
    BACKSPACE = 127,
    ARROW_LEFT = 1000,
@@ -92,6 +539,9 @@ enum editor_key {
    HOME_KEY,
    END_KEY,
    DEL_KEY,
+   PASTE_START,
+   PASTE_STRAY_END,
+   MOUSE_EVENT,
    ENABLE_MODE_READING = 27,
    ENABLE_MODE_EDITING = 105,
    READING_ENABLE_COMMANDS = 58,
@@ -108,17 +558,24 @@ enum editor_highlight {
    HL_MATCH
 };
 
-void ab_append(struct abuf * ab, const char * s, int len) {
-   char * new = realloc(ab->b, ab->len + len);
+void die(const char * s);
 
-   if (new == NULL) return;
-   memcpy(&new[ab->len], s, len);
+// makes room for len more bytes
+static inline void ab_reserve(struct abuf * ab, int len) {
+   if (ab->len + len <= ab->cap) return;
+
+   int cap = ab->cap ? ab->cap * 2 : 4096;
+   while (cap < ab->len + len) cap *= 2;
+   char * new = realloc(ab->b, cap);
+   if (new == NULL) die("realloc");
    ab->b = new;
-   ab->len += len;
+   ab->cap = cap;
 }
 
-void ab_free(struct abuf * ab) {
-   free(ab->b);
+static inline void ab_append(struct abuf * ab, const char * s, int len) {
+   ab_reserve(ab, len);
+   memcpy(&ab->b[ab->len], s, len);
+   ab->len += len;
 }
 
 int num_digits(int num)
@@ -134,8 +591,25 @@ int num_digits(int num)
 
 struct EditorConfig E;
 
+void editor_render_text(struct row_render * r, const char * s0, int n0, const char * s1, int n1);
+int editor_hl_row(erow * row, int state, struct row_render * scratch);
+void row_render_free(struct row_render * r);
+struct row_render * editor_row_refresh(int at);
+struct render_entry * editor_row_matches(int at);
+void editor_search_poll();
+void editor_idle();
+void editor_refresh_screen();
+void editor_timer_set(void (*fn)(), int ms);
+void editor_save_check();
+void editor_journal_rebase(const char * target, long long journaled);
+void editor_journal_flush();
+
+void editor_drain_output();
+
 void die(const char * s)
 {
+   editor_journal_flush();
+   editor_drain_output();
    write(STDOUT_FILENO, "\x1b[2J", 4);
    write(STDOUT_FILENO, "\x1b[H", 3);
 
@@ -144,6 +618,8 @@ void die(const char * s)
 }
 
 void disable_raw_mode() {
+   write(STDOUT_FILENO, PASTE_MODE_OFF, strlen(PASTE_MODE_OFF));
+   write(STDOUT_FILENO, MOUSE_MODE_OFF, strlen(MOUSE_MODE_OFF));
    if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &E.orig_termios) == -1)
       die("tcsetattr");
 }
@@ -159,16 +635,586 @@ void enable_raw_mode() {
    raw.c_cflag |= (CS8);
    raw.c_lflag &= ~(ECHO | ICANON | ISIG | IEXTEN);
    raw.c_cc[VMIN] = 0;
-   raw.c_cc[VTIME] = 1;
+   raw.c_cc[VTIME] = 0;
 
    if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1) die("tcsetattr");
+   write(STDOUT_FILENO, PASTE_MODE_ON, strlen(PASTE_MODE_ON));
+   write(STDOUT_FILENO, MOUSE_MODE_ON, strlen(MOUSE_MODE_ON));
+}
+
+// number of online cores, looked up once since sysconf reads it from /sys
+int editor_cpus()
+{
+   static int cpus = 0;
+   if (cpus == 0) {
+      long n = sysconf(_SC_NPROCESSORS_ONLN);
+      cpus = n > 0 ? n : 1;
+   }
+   return cpus;
+}
+
+struct row_node * row_node_new(int leaf)
+{
+   struct row_node * node = calloc(1, sizeof(struct row_node));
+   if (node == NULL) die("calloc");
+   node->leaf = leaf;
+   if (leaf) {
+      node->u.rows = malloc(sizeof(erow) * ROW_NODE_MAX);
+      if (node->u.rows == NULL) die("malloc");
+   }
+   return node;
+}
+
+int row_node_count(struct row_node * node)
+{
+   if (node->leaf) return node->n;
+
+   int count = 0;
+   for (int i = 0; i < node->n; i++) count += node->u.in.counts[i];
+   return count;
+}
+
+int row_node_slot(struct row_node * node)
+{
+   struct row_node * parent = node->parent;
+   int slot = 0;
+   while (parent->u.in.child[slot] != node) slot++;
+   return slot;
+}
+
+// forgets the byte totals of node and everything above it
+void row_node_bytes_stale(struct row_node * node)
+{
+   for (; node; node = node->parent) node->bytes_ok = 0;
+}
+
+// add delta to the row count of every ancestor of node
+void row_node_adjust(struct row_node * node, int delta)
+{
+   row_node_bytes_stale(node);
+   while (node->parent) {
+      node->parent->u.in.counts[row_node_slot(node)] += delta;
+      node = node->parent;
+   }
+}
+
+// points children (or the rows of a leaf) in [from, to) back at node
+void row_node_reparent(struct row_node * node, int from, int to)
+{
+   for (int i = from; i < to; i++) {
+      if (node->leaf) node->u.rows[i].leaf = node;
+      else node->u.in.child[i]->parent = node;
+   }
+}
+
+// moves the entries [from, from + len) of src to position at of dst
+void row_node_move(struct row_node * dst, int at, struct row_node * src, int from, int len)
+{
+   if (dst->leaf) {
+      memmove(&dst->u.rows[at + len], &dst->u.rows[at], sizeof(erow) * (dst->n - at));
+      memcpy(&dst->u.rows[at], &src->u.rows[from], sizeof(erow) * len);
+      memmove(&src->u.rows[from], &src->u.rows[from + len], sizeof(erow) * (src->n - from - len));
+   } else {
+      memmove(&dst->u.in.child[at + len], &dst->u.in.child[at], sizeof(struct row_node *) * (dst->n - at));
+      memmove(&dst->u.in.counts[at + len], &dst->u.in.counts[at], sizeof(int) * (dst->n - at));
+      memcpy(&dst->u.in.child[at], &src->u.in.child[from], sizeof(struct row_node *) * len);
+      memcpy(&dst->u.in.counts[at], &src->u.in.counts[from], sizeof(int) * len);
+      memmove(&src->u.in.child[from], &src->u.in.child[from + len], sizeof(struct row_node *) * (src->n - from - len));
+      memmove(&src->u.in.counts[from], &src->u.in.counts[from + len], sizeof(int) * (src->n - from - len));
+   }
+   dst->n += len;
+   src->n -= len;
+   row_node_reparent(dst, 0, dst->n);
+   row_node_bytes_stale(dst);
+   row_node_bytes_stale(src);
+}
+
+// moves the upper half of a full node into a new sibling right after it
+void row_node_split(struct row_node * node)
+{
+   struct row_node * parent = node->parent;
+   if (parent == NULL) {
+      parent = row_node_new(0);
+      parent->n = 1;
+      parent->u.in.child[0] = node;
+      parent->u.in.counts[0] = row_node_count(node);
+      node->parent = parent;
+      E.rows = parent;
+   } else if (parent->n == ROW_NODE_MAX) {
+      row_node_split(parent);
+      parent = node->parent;
+   }
+
+   struct row_node * sibling = row_node_new(node->leaf);
+   row_node_move(sibling, 0, node, node->n / 2, node->n - node->n / 2);
+
+   int slot = row_node_slot(node);
+   int moved = row_node_count(sibling);
+   memmove(&parent->u.in.child[slot + 2], &parent->u.in.child[slot + 1],
+         sizeof(struct row_node *) * (parent->n - slot - 1));
+   memmove(&parent->u.in.counts[slot + 2], &parent->u.in.counts[slot + 1],
+         sizeof(int) * (parent->n - slot - 1));
+   parent->u.in.child[slot + 1] = sibling;
+   parent->u.in.counts[slot + 1] = moved;
+   parent->u.in.counts[slot] -= moved;
+   parent->n++;
+   sibling->parent = parent;
+}
+
+// text of the map line running from start to end, minus its line ending
+char * editor_map_line(off_t start, off_t end, int * len)
+{
+   while (end > start && (E.map[end - 1] == '\n' || E.map[end - 1] == '\r'))
+      end--;
+   *len = end - start;
+   return &E.map[start];
+}
+
+void editor_row_init(erow * row, char * s, size_t len)
+{
+   row->size = len;
+   row->gap = len;
+   row->gaplen = 0;
+   row->chars = malloc(len + 1);
+   memcpy(row->chars, s, len);
+   row->chars[len] = '\0';
+
+   row->hl_start = 0;
+   row->hl_open_comment = 0;
+   row->stale = 1;
+   row->rslot = -1;
+   row->rtag = 0;
+}
+
+// turns a lazy leaf into real rows in place
+struct row_node * row_leaf_load(struct row_node * leaf)
+{
+   if (!leaf->lazy) return leaf;
+
+   pthread_rwlock_wrlock(&E.leaf_lock);
+   off_t offs[ROW_NODE_MAX + 1];
+   memcpy(offs, leaf->u.offs, sizeof(off_t) * (leaf->n + 1));
+
+   struct row_node * node = leaf;
+   node->u.rows = malloc(sizeof(erow) * ROW_NODE_MAX);
+   if (node->u.rows == NULL) die("malloc");
+
+   // a leaf highlighted while lazy hands its rows their comment states,
+   // since rows above the watermark aren't looked at again
+   struct row_render scratch = { NULL, 0, 0, NULL, 0 };
+   int state = node->hl_start;
+   int highlight = node->hl_done && E.syntax;
+
+   node->lazy = 0;
+   node->hl_done = 0;
+   for (int i = 0; i < node->n; i++) {
+      int len;
+      char * line = editor_map_line(offs[i], offs[i + 1], &len);
+      editor_row_init(&node->u.rows[i], line, len);
+      node->u.rows[i].leaf = node;
+      if (highlight) state = editor_hl_row(&node->u.rows[i], state, &scratch);
+   }
+   pthread_rwlock_unlock(&E.leaf_lock);
+   row_render_free(&scratch);
+   return node;
+}
+
+// merges or evens out a node that fell below a quarter full with a sibling
+void row_node_rebalance(struct row_node * node)
+{
+   struct row_node * parent = node->parent;
+   if (parent == NULL) {
+      if (!node->leaf && node->n == 1) {
+         E.rows = node->u.in.child[0];
+         E.rows->parent = NULL;
+         free(node);
+      }
+      return;
+   }
+   if (node->n >= ROW_NODE_MAX / 4) return;
+
+   int slot = row_node_slot(node);
+   if (slot == parent->n - 1) slot--;
+   if (node->leaf) {
+      row_leaf_load(parent->u.in.child[slot]);
+      row_leaf_load(parent->u.in.child[slot + 1]);
+   }
+   struct row_node * left = parent->u.in.child[slot];
+   struct row_node * right = parent->u.in.child[slot + 1];
+
+   if (left->n + right->n <= ROW_NODE_MAX) {
+      row_node_move(left, left->n, right, 0, right->n);
+      parent->u.in.counts[slot] += parent->u.in.counts[slot + 1];
+      memmove(&parent->u.in.child[slot + 1], &parent->u.in.child[slot + 2],
+            sizeof(struct row_node *) * (parent->n - slot - 2));
+      memmove(&parent->u.in.counts[slot + 1], &parent->u.in.counts[slot + 2],
+            sizeof(int) * (parent->n - slot - 2));
+      parent->n--;
+      if (right->leaf) free(right->u.rows);
+      free(right);
+      row_node_rebalance(parent);
+      return;
+   }
+
+   int total = left->n + right->n;
+   if (left->n > right->n) {
+      row_node_move(right, 0, left, total / 2, left->n - total / 2);
+   } else {
+      row_node_move(left, left->n, right, 0, right->n - (total - total / 2));
+   }
+   int left_count = row_node_count(left);
+   parent->u.in.counts[slot + 1] += parent->u.in.counts[slot] - left_count;
+   parent->u.in.counts[slot] = left_count;
+}
+
+// finds the leaf holding row at, leaving the position inside it in *pos.
+// the leaf may still be lazy
+struct row_node * row_tree_locate(int at, int * pos)
+{
+   struct row_node * node = E.rows;
+   while (!node->leaf) {
+      int i = 0;
+      while (i < node->n - 1 && at >= node->u.in.counts[i]) {
+         at -= node->u.in.counts[i];
+         i++;
+      }
+      node = node->u.in.child[i];
+   }
+   *pos = at;
+   return node;
+}
+
+// length of row i of leaf when saved, newline included
+long long row_leaf_row_bytes(struct row_node * leaf, int i)
+{
+   if (!leaf->lazy) return leaf->u.rows[i].size + 1;
+   int len;
+   editor_map_line(leaf->u.offs[i], leaf->u.offs[i + 1], &len);
+   return len + 1;
+}
+
+long long row_node_bytes(struct row_node * node)
+{
+   if (node->bytes_ok) return node->bytes;
+
+   long long bytes = 0;
+   for (int i = 0; i < node->n; i++) {
+      if (node->leaf) bytes += row_leaf_row_bytes(node, i);
+      else bytes += row_node_bytes(node->u.in.child[i]);
+   }
+   node->bytes = bytes;
+   node->bytes_ok = 1;
+   return bytes;
+}
+
+// where row at starts in the file as saved. at == E.numrows gives its size
+long long row_tree_offset(int at)
+{
+   struct row_node * node = E.rows;
+   long long off = 0;
+   while (!node->leaf) {
+      int i = 0;
+      while (i < node->n - 1 && at >= node->u.in.counts[i]) {
+         at -= node->u.in.counts[i];
+         off += row_node_bytes(node->u.in.child[i]);
+         i++;
+      }
+      node = node->u.in.child[i];
+   }
+   for (int i = 0; i < at && i < node->n; i++) off += row_leaf_row_bytes(node, i);
+   return off;
+}
+
+struct row_node * row_tree_find(int at, int * pos)
+{
+   return row_leaf_load(row_tree_locate(at, pos));
+}
+
+erow * editor_row_at(int at)
+{
+   int pos;
+   struct row_node * leaf = row_tree_find(at, &pos);
+   return &leaf->u.rows[pos];
+}
+
+struct row_node * row_tree_first_leaf()
+{
+   struct row_node * node = E.rows;
+   while (!node->leaf) node = node->u.in.child[0];
+   return node;
+}
+
+struct row_node * row_leaf_next(struct row_node * node)
+{
+   while (node->parent) {
+      int slot = row_node_slot(node);
+      if (slot + 1 < node->parent->n) {
+         node = node->parent->u.in.child[slot + 1];
+         while (!node->leaf) node = node->u.in.child[0];
+         return node;
+      }
+      node = node->parent;
+   }
+   return NULL;
+}
+
+// index of a row, worked out from where it sits in the tree
+int editor_row_idx(erow * row)
+{
+   struct row_node * node = row->leaf;
+   int idx = row - node->u.rows;
+   while (node->parent) {
+      int slot = row_node_slot(node);
+      for (int i = 0; i < slot; i++) idx += node->parent->u.in.counts[i];
+      node = node->parent;
+   }
+   return idx;
+}
+
+// opens up an empty row slot at index at. invalidates other erow pointers
+erow * row_tree_insert(int at)
+{
+   int pos;
+   struct row_node * leaf = row_tree_find(at, &pos);
+   if (leaf->n == ROW_NODE_MAX) {
+      row_node_split(leaf);
+      if (pos > leaf->n) {
+         pos -= leaf->n;
+         leaf = leaf->parent->u.in.child[row_node_slot(leaf) + 1];
+      }
+   }
+
+   memmove(&leaf->u.rows[pos + 1], &leaf->u.rows[pos], sizeof(erow) * (leaf->n - pos));
+   leaf->n++;
+   row_node_reparent(leaf, pos, pos + 1);
+   row_node_adjust(leaf, 1);
+   return &leaf->u.rows[pos];
+}
+
+// drops row at from the tree. invalidates other erow pointers
+void row_tree_remove(int at)
+{
+   int pos;
+   struct row_node * leaf = row_tree_find(at, &pos);
+   memmove(&leaf->u.rows[pos], &leaf->u.rows[pos + 1], sizeof(erow) * (leaf->n - pos - 1));
+   leaf->n--;
+   row_node_adjust(leaf, -1);
+   row_node_rebalance(leaf);
+}
+
+// stacks a level of nodes under new parents until one root is left
+struct row_node * row_tree_build(struct row_node ** nodes, int n)
+{
+   while (n > 1) {
+      int parents = (n + ROW_NODE_MAX - 1) / ROW_NODE_MAX;
+      for (int p = 0; p < parents; p++) {
+         // spread the children evenly so no parent starts out underfull
+         int from = (long long)n * p / parents;
+         int to = (long long)n * (p + 1) / parents;
+         struct row_node * parent = row_node_new(0);
+         for (int i = from; i < to; i++) {
+            parent->u.in.child[i - from] = nodes[i];
+            parent->u.in.counts[i - from] = row_node_count(nodes[i]);
+            nodes[i]->parent = parent;
+         }
+         parent->n = to - from;
+         nodes[p] = parent;
+      }
+      n = parents;
+   }
+   return nodes[0];
+}
+
+/* one chunk of the map. chunks are scanned for newlines by separate
+ * threads, each building its own run of lazy leaves, and the runs are
+ * stitched back together in order */
+struct line_chunk {
+   off_t from, to;
+   struct row_node ** leaves;
+   int nleaves, cap;
+   int lines;
+   int cr;
+};
+
+// adds a lazy line starting at off, opening a new leaf when the last is full
+void line_chunk_push(struct line_chunk * chunk, off_t off)
+{
+   struct row_node * leaf = chunk->nleaves ? chunk->leaves[chunk->nleaves - 1] : NULL;
+   if (leaf == NULL || leaf->n == ROW_NODE_MAX) {
+      if (leaf) leaf->u.offs[leaf->n] = off;
+      leaf = calloc(1, sizeof(struct row_node));
+      if (leaf == NULL) die("calloc");
+      leaf->leaf = 1;
+      leaf->lazy = 1;
+      if (chunk->nleaves == chunk->cap) {
+         chunk->cap = chunk->cap ? chunk->cap * 2 : 64;
+         chunk->leaves = realloc(chunk->leaves, sizeof(struct row_node *) * chunk->cap);
+         if (chunk->leaves == NULL) die("realloc");
+      }
+      chunk->leaves[chunk->nleaves++] = leaf;
+   }
+   leaf->u.offs[leaf->n++] = off;
+   chunk->lines++;
+}
+
+// every newline that isn't the last byte of the file starts a line
+void * line_chunk_scan(void * arg)
+{
+   struct line_chunk * chunk = arg;
+   const char * map = E.map;
+   off_t end = chunk->to == (off_t)E.map_len ? chunk->to - 1 : chunk->to;
+   off_t i = chunk->from;
+
+   if (i == 0) line_chunk_push(chunk, 0);
+   chunk->cr = memchr(&map[chunk->from], '\r', chunk->to - chunk->from) != NULL;
+
+#ifdef __SSE2__
+   const __m128i nl = _mm_set1_epi8('\n');
+   for (; i + 16 <= end; i += 16) {
+      __m128i block = _mm_loadu_si128((const __m128i *)&map[i]);
+      unsigned int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(block, nl));
+      while (mask) {
+         line_chunk_push(chunk, i + __builtin_ctz(mask) + 1);
+         mask &= mask - 1;
+      }
+   }
+#endif
+
+   while (i < end) {
+      const char * found = memchr(&map[i], '\n', end - i);
+      if (found == NULL) break;
+      i = found - map + 1;
+      line_chunk_push(chunk, i);
+   }
+   return NULL;
+}
+
+// indexes the lines of E.map into a tree of lazy leaves. big maps are cut
+// into one chunk per core and scanned for newlines in parallel. returns
+// whether the map has a \r in it
+int row_tree_build_lazy()
+{
+   if (E.map_len == 0) return 0;
+
+   int cpus = editor_cpus();
+   int nchunks = E.map_len / LINE_CHUNK_MIN + 1;
+   if (nchunks > cpus) nchunks = cpus;
+   if (nchunks > LINE_CHUNK_THREADS) nchunks = LINE_CHUNK_THREADS;
+
+   struct line_chunk chunks[LINE_CHUNK_THREADS];
+   pthread_t threads[LINE_CHUNK_THREADS];
+   int started[LINE_CHUNK_THREADS];
+   int c;
+   memset(chunks, 0, sizeof(chunks));
+   for (c = 0; c < nchunks; c++) {
+      chunks[c].from = (off_t)((unsigned long long)E.map_len * c / nchunks);
+      chunks[c].to = (off_t)((unsigned long long)E.map_len * (c + 1) / nchunks);
+   }
+   for (c = 1; c < nchunks; c++)
+      started[c] = pthread_create(&threads[c], NULL, line_chunk_scan, &chunks[c]) == 0;
+   line_chunk_scan(&chunks[0]);
+   for (c = 1; c < nchunks; c++) {
+      if (started[c]) pthread_join(threads[c], NULL);
+      else line_chunk_scan(&chunks[c]);
+   }
+
+   // stitch the runs of leaves together. the last line of each run ends
+   // where the next run's first line starts
+   int nleaves = 0;
+   int cr = 0;
+   for (c = 0; c < nchunks; c++) {
+      nleaves += chunks[c].nleaves;
+      cr |= chunks[c].cr;
+   }
+   struct row_node ** leaves = malloc(sizeof(struct row_node *) * nleaves);
+   struct row_node * last = NULL;
+   nleaves = 0;
+   for (c = 0; c < nchunks; c++) {
+      if (chunks[c].nleaves == 0) continue;
+      if (last) last->u.offs[last->n] = chunks[c].leaves[0]->u.offs[0];
+      memcpy(&leaves[nleaves], chunks[c].leaves, sizeof(struct row_node *) * chunks[c].nleaves);
+      nleaves += chunks[c].nleaves;
+      last = leaves[nleaves - 1];
+      E.numrows += chunks[c].lines;
+      free(chunks[c].leaves);
+   }
+   last->u.offs[last->n] = E.map_len;
+
+   free(E.rows->u.rows);
+   free(E.rows);
+   E.rows = row_tree_build(leaves, nleaves);
+   free(leaves);
+   return cr;
+}
+
+char editor_row_char(erow * row, int at)
+{
+   return at < row->gap ? row->chars[at] : row->chars[at + row->gaplen];
+}
+
+void editor_row_move_gap(erow * row, int at)
+{
+   if (at < row->gap) {
+      memmove(&row->chars[at + row->gaplen], &row->chars[at], row->gap - at);
+   } else if (at > row->gap) {
+      memmove(&row->chars[row->gap], &row->chars[row->gap + row->gaplen], at - row->gap);
+   }
+   row->gap = at;
+}
+
+// makes sure the gap can take len more bytes, growing it geometrically
+void editor_row_reserve(erow * row, int len)
+{
+   if (row->gaplen >= len) return;
+
+   int gaplen = len + row->size / 4 + ROW_GAP_MIN;
+   int tail = row->size - row->gap;
+   row->chars = realloc(row->chars, row->size + gaplen + 1);
+   memmove(&row->chars[row->gap + gaplen], &row->chars[row->gap + row->gaplen], tail);
+   row->gaplen = gaplen;
+}
+
+// closes the gap so chars can be read as one nul terminated string
+char * editor_row_chars(erow * row)
+{
+   editor_row_move_gap(row, row->size);
+   row->chars[row->size] = '\0';
+   return row->chars;
+}
+
+// control characters (tabs included) are the only bytes that don't
+// render as themselves
+static inline int is_control(unsigned char c)
+{
+   return c < 0x20 || c == 0x7f;
+}
+
+// length of the run of bytes at s, at most len, that holds no control
+// characters. compares 16 bytes at a time where SSE2 is available
+static inline int render_plain_len(const char * s, int len)
+{
+   int i = 0;
+#ifdef __SSE2__
+   const __m128i low = _mm_set1_epi8(0x1f);
+   const __m128i del = _mm_set1_epi8(0x7f);
+   for (; i + 16 <= len; i += 16) {
+      __m128i block = _mm_loadu_si128((const __m128i *)&s[i]);
+      __m128i ctrl = _mm_or_si128(
+            _mm_cmpeq_epi8(_mm_min_epu8(block, low), block),
+            _mm_cmpeq_epi8(block, del));
+      unsigned int mask = _mm_movemask_epi8(ctrl);
+      if (mask) return i + __builtin_ctz(mask);
+   }
+#endif
+   while (i < len && !is_control(s[i])) i++;
+   return i;
 }
 
 int editor_row_cx_to_rx(erow * row, int cx) {
    int rx = 0;
    int j;
    for (j = 0; j < cx; j++) {
-      if (row->chars[j] == '\t')
+      if (editor_row_char(row, j) == '\t')
          rx += (E.tab_stop - 1) - (rx % E.tab_stop);
       rx++;
    }
@@ -181,14 +1227,12 @@ int editor_row_rx_to_cx(erow * row, int rx) {
    int cur_rx = 0;
    int cx;
    for (cx = 0; cx < row->size; cx++) {
-      if (row->chars[cx] == '\t')
+      if (editor_row_char(row, cx) == '\t')
          cur_rx += (E.tab_stop - 1) - (cur_rx % E.tab_stop);
       cur_rx++;
 
       if (cur_rx > rx) return cx;
    }
-   if (E.show_line_numbers)
-      return cx - num_digits(E.numrows) - LEFT_MARGIN_SIZE;
    return cx;
 }
 
@@ -209,7 +1253,7 @@ void editor_scroll()
 {
    E.rx = 0;
    if (E.cy < E.numrows) {
-      E.rx = editor_row_cx_to_rx(&E.row[E.cy], E.cx);
+      E.rx = editor_row_cx_to_rx(editor_row_at(E.cy), E.cx);
    }
 
    if (E.cy < E.rowoff) {
@@ -226,45 +1270,309 @@ void editor_scroll()
    }
 }
 
-void editor_draw_rows(struct abuf * ab) {
-   int y;
-   int welcome_index = 0;
-   for (y = 0; y < E.screenrows; ++y) {
-      int filerow = y + E.rowoff; 
-      if (filerow >= E.numrows) {
-         if (E.numrows == 0 && y >= E.screenrows / 3 && y < (E.screenrows) / 3 + YAR_WELCOME_LINE_COUNT) {
-            char message[80];
-            strcpy(message, YAR_WELCOME[welcome_index++]);
-            int messagelen = strlen(message);
+// makes sure the grids match the window, starting over from a blank
+// screen when they don't
+void screen_resize()
+{
+   int rows = E.screenrows + 2;
+   if (E.frame && E.frame_rows == rows && E.frame_cols == E.screencols) return;
+
+   free(E.frame);
+   free(E.shadow);
+   free(E.frame_odd);
+   free(E.shadow_odd);
+   E.frame_rows = rows;
+   E.frame_cols = E.screencols;
+   E.frame = malloc(sizeof(struct screen_cell) * rows * E.screencols);
+   E.shadow = malloc(sizeof(struct screen_cell) * rows * E.screencols);
+   E.frame_odd = malloc(rows);
+   E.shadow_odd = malloc(rows);
+   if (E.frame == NULL || E.shadow == NULL || E.frame_odd == NULL || E.shadow_odd == NULL)
+      die("malloc");
+   E.shadow_valid = 0;
+}
 
-            // special case for line 1 (version)
-            if (welcome_index == 1) { 
-               messagelen = snprintf(message, sizeof(message), YAR_WELCOME[welcome_index - 1], YAR_VERSION);
-            }
+static inline void screen_cell_set(struct screen_cell * cell, const char * s, int n, unsigned char attr)
+{
+   memset(cell->glyph, 0, sizeof(cell->glyph));
+   memcpy(cell->glyph, s, n);
+   cell->len = n;
+   cell->attr = attr;
+}
 
-            if (messagelen > E.screencols) messagelen = E.screencols;
-            int padding = (E.screencols - messagelen) / 2;
-            if (padding) {
-               ab_append(ab, "~", 1);
-               padding--;
-            }
-            while (padding--) ab_append(ab, " ", 1);
-            ab_append(ab, message, messagelen);
-         } else {
-            ab_append(ab, "~", 1);
-         }
-      } else {
-         int total_left_margin_size = num_digits(E.numrows) + LEFT_MARGIN_SIZE;
-         char linenum[10]; // i think we can assume we prolly wont be opening million+ line files!
-         int linenumlen = snprintf(linenum, sizeof(linenum), "%*d%s", num_digits(E.numrows), (E.rowoff + y + 1), LEFT_MARGIN);
-         if (E.show_line_numbers) {
-            ab_append(ab, "\x1b[36m", 5);
-            ab_append(ab, linenum, linenumlen);
-            ab_append(ab, "\x1b[39m", 5);
-         }
+static inline int screen_cell_blank(const struct screen_cell * cell)
+{
+   return cell->len == 1 && cell->glyph[0] == ' ' && cell->attr == 0;
+}
 
-         int len = E.row[filerow].rsize - E.coloff;
-         if (len < 0) len = 0;
+void screen_clear(struct screen_cell * grid, unsigned char * odd)
+{
+   for (int i = 0; i < E.frame_rows * E.frame_cols; i++)
+      screen_cell_set(&grid[i], " ", 1, 0);
+   memset(odd, 0, E.frame_rows);
+}
+
+// how many columns the terminal gives the n byte UTF-8 character at s,
+// -1 when there's no telling
+int screen_char_width(const char * s, int n)
+{
+   if (E.utf8 == (locale_t)0) return -1;
+
+   const unsigned char * u = (const unsigned char *)s;
+   wchar_t wc = u[0] & (0xff >> (n + 1));
+   for (int k = 1; k < n; k++) wc = (wc << 6) | (u[k] & 0x3f);
+
+   locale_t old = uselocale(E.utf8);
+   int width = wcwidth(wc);
+   uselocale(old);
+   return width;
+}
+
+// writes len bytes of s into row y of the frame from column x, one cell
+// per UTF-8 character (two for wide ones), and returns the column after
+// them. bytes that aren't part of a whole character get a cell each
+int screen_put(int y, int x, const char * s, int len, unsigned char attr)
+{
+   struct screen_cell * row = &E.frame[y * E.frame_cols];
+   int i = 0;
+   while (i < len && x < E.frame_cols) {
+      unsigned char c = s[i];
+      int n = 1;
+      if (c >= 0xc0 && c < 0xf8) n = c >= 0xf0 ? 4 : c >= 0xe0 ? 3 : 2;
+      if (i + n > len) n = 1;
+      for (int k = 1; k < n; k++)
+         if (((unsigned char)s[i + k] & 0xc0) != 0x80) n = 1;
+
+      // a stray byte of a character shows as however the terminal likes
+      int width = n > 1 ? screen_char_width(&s[i], n) : c < 0x80 ? 1 : -1;
+      if (width == 2 && x + 1 == E.frame_cols) {
+         // half of it won't fit
+         screen_cell_set(&row[x++], " ", 1, attr);
+      } else if (width == 2) {
+         screen_cell_set(&row[x++], &s[i], n, attr);
+         screen_cell_set(&row[x++], "", 0, attr);
+      } else {
+         if (width != 1) E.frame_odd[y] = 1;
+         screen_cell_set(&row[x++], &s[i], n, attr);
+      }
+      i += n;
+   }
+   return x;
+}
+
+// the SGR sequence for every attribute byte, built the first time one's
+// needed so changing colour is a single copy
+void screen_sgr(struct abuf * ab, unsigned char attr)
+{
+   static char seq[256][12];
+   static int seqlen[256] = { 0 };
+
+   if (seqlen[0] == 0) {
+      for (int a = 0; a < 256; a++) {
+         int len = snprintf(seq[a], sizeof(seq[a]), "\x1b[0%s", a & ATTR_REVERSE ? ";7" : "");
+         if (a & ~ATTR_REVERSE) len += snprintf(&seq[a][len], sizeof(seq[a]) - len, ";%d", a & ~ATTR_REVERSE);
+         seq[a][len++] = 'm';
+         seqlen[a] = len;
+      }
+   }
+   ab_append(ab, seq[attr], seqlen[attr]);
+}
+
+// moves the terminal's cursor to (x, y) in as few bytes as it can
+void screen_move(struct abuf * ab, int x, int y)
+{
+   char buf[32];
+   int len;
+   if (E.term_y == y && E.term_x == x) return;
+
+   if (E.term_x < 0 || E.term_y < 0 || x >= E.frame_cols)
+      len = snprintf(buf, sizeof(buf), "\x1b[%d;%dH", y + 1, x + 1);
+   else if (E.term_y == y && x == 0) len = snprintf(buf, sizeof(buf), "\r");
+   else if (E.term_y + 1 == y && x == 0) len = snprintf(buf, sizeof(buf), "\r\n");
+   else if (E.term_y == y && x > E.term_x) len = snprintf(buf, sizeof(buf), "\x1b[%dC", x - E.term_x);
+   else if (E.term_y == y) len = snprintf(buf, sizeof(buf), "\x1b[%dD", E.term_x - x);
+   else len = snprintf(buf, sizeof(buf), "\x1b[%d;%dH", y + 1, x + 1);
+
+   ab_append(ab, buf, len);
+   E.term_x = x < E.frame_cols ? x : -1;
+   E.term_y = x < E.frame_cols ? y : -1;
+}
+
+// runs of this many unchanged cells or fewer are rewritten rather than
+// skipped, since moving past them costs about as much
+#define SCREEN_SKIP_MIN 4
+
+/* scrolls the text rows of the terminal, and the shadow with them, by n
+ * rows (up when positive) inside a scroll region that stops above the
+ * status bar. the rows that come into view are all that's left to send */
+void screen_scroll(struct abuf * ab, int n)
+{
+   int rows = E.screenrows;
+   int cols = E.frame_cols;
+   int by = n > 0 ? n : -n;
+
+   char buf[32];
+   int len = snprintf(buf, sizeof(buf), "\x1b[1;%dr\x1b[%d%c\x1b[r", rows, by, n > 0 ? 'S' : 'T');
+   ab_append(ab, buf, len);
+
+   struct screen_cell * old = E.shadow;
+   if (n > 0) {
+      memmove(old, &old[by * cols], sizeof(struct screen_cell) * (rows - by) * cols);
+      old = &old[(rows - by) * cols];
+   } else {
+      memmove(&old[by * cols], old, sizeof(struct screen_cell) * (rows - by) * cols);
+   }
+   for (int i = 0; i < by * cols; i++) screen_cell_set(&old[i], " ", 1, 0);
+
+   unsigned char * odd = E.shadow_odd;
+   if (n > 0) {
+      memmove(odd, &odd[by], rows - by);
+      memset(&odd[rows - by], 0, by);
+   } else {
+      memmove(&odd[by], odd, rows - by);
+      memset(odd, 0, by);
+   }
+
+   // setting the region homes the cursor
+   E.term_x = E.term_y = -1;
+}
+
+/* appends what it takes to turn the shadow into the frame, then makes the
+ * frame the new shadow. the view having moved by scroll rows since the
+ * last frame is made up for by scrolling the terminal when that saves
+ * resending rows. returns whether any cell changed */
+int screen_flush(struct abuf * ab, int scroll)
+{
+   int changed = 0;
+   int attr = 0;
+
+   if (!E.shadow_valid) {
+      ab_append(ab, "\x1b[?25l\x1b[0m\x1b[2J", 14);
+      screen_clear(E.shadow, E.shadow_odd);
+      E.term_x = E.term_y = -1;
+      E.shadow_valid = 1;
+      changed = 1;
+   } else if (scroll != 0 && scroll < E.screenrows && -scroll < E.screenrows) {
+      ab_append(ab, "\x1b[?25l", 6);
+      screen_scroll(ab, scroll);
+      changed = 1;
+   }
+
+   for (int y = 0; y < E.frame_rows; y++) {
+      struct screen_cell * row = &E.frame[y * E.frame_cols];
+      struct screen_cell * old = &E.shadow[y * E.frame_cols];
+
+      // past blank, the row can be cleared rather than written
+      int blank = E.frame_cols;
+      while (blank > 0 && screen_cell_blank(&row[blank - 1])) blank--;
+
+      // where the cells of a row with odd widths in it, now or before,
+      // end up on the terminal isn't known, so it's rewritten whole
+      int whole = E.frame_odd[y] || E.shadow_odd[y];
+
+      int x = 0;
+      while (x < E.frame_cols) {
+         if (!memcmp(&row[x], &old[x], sizeof(struct screen_cell))) {
+            x++;
+            continue;
+         }
+         if (!changed) ab_append(ab, "\x1b[?25l", 6);
+         changed = 1;
+
+         if (whole) {
+            screen_move(ab, 0, y);
+            for (x = 0; x < blank; x++) {
+               if (row[x].attr != attr) screen_sgr(ab, attr = row[x].attr);
+               ab_append(ab, row[x].glyph, row[x].len);
+            }
+            if (attr != 0) screen_sgr(ab, attr = 0);
+            if (blank < E.frame_cols) ab_append(ab, "\x1b[K", 3);
+            E.term_x = E.term_y = -1;
+            break;
+         }
+
+         if (x >= blank) {
+            screen_move(ab, x, y);
+            if (attr != 0) screen_sgr(ab, attr = 0);
+            ab_append(ab, "\x1b[K", 3);
+            break;
+         }
+
+         int end = x + 1, same = 0;
+         for (int k = end; k < blank && same <= SCREEN_SKIP_MIN; k++) {
+            if (memcmp(&row[k], &old[k], sizeof(struct screen_cell))) {
+               end = k + 1;
+               same = 0;
+            } else {
+               same++;
+            }
+         }
+         // the second column of a wide character goes with its first
+         while (end < E.frame_cols && row[end].len == 0) end++;
+
+         // cells of one colour are copied straight in, room for the
+         // whole span having been made up front
+         screen_move(ab, x, y);
+         while (x < end) {
+            if (row[x].attr != attr) screen_sgr(ab, attr = row[x].attr);
+            ab_reserve(ab, (end - x) * sizeof(row[x].glyph));
+            char * p = &ab->b[ab->len];
+            for (; x < end && row[x].attr == attr; x++) {
+               memcpy(p, row[x].glyph, sizeof(row[x].glyph));
+               p += row[x].len;
+            }
+            ab->len = p - ab->b;
+         }
+         // the last column leaves the cursor waiting to wrap
+         E.term_x = x < E.frame_cols ? x : -1;
+         if (E.term_x == -1) E.term_y = -1;
+      }
+   }
+   if (attr != 0) screen_sgr(ab, 0);
+
+   struct screen_cell * swap = E.shadow;
+   E.shadow = E.frame;
+   E.frame = swap;
+   unsigned char * odd = E.shadow_odd;
+   E.shadow_odd = E.frame_odd;
+   E.frame_odd = odd;
+   return changed;
+}
+
+void editor_draw_rows() {
+   int y;
+   int welcome_index = 0;
+   for (y = 0; y < E.screenrows; ++y) {
+      int filerow = y + E.rowoff; 
+      if (filerow >= E.numrows) {
+         if (E.numrows == 0 && y >= E.screenrows / 3 && y < (E.screenrows) / 3 + YAR_WELCOME_LINE_COUNT) {
+            char message[80];
+            strcpy(message, YAR_WELCOME[welcome_index++]);
+            int messagelen = strlen(message);
+
+            // special case for line 1 (version)
+            if (welcome_index == 1) { 
+               messagelen = snprintf(message, sizeof(message), YAR_WELCOME[welcome_index - 1], YAR_VERSION);
+            }
+
+            if (messagelen > E.screencols) messagelen = E.screencols;
+            int padding = (E.screencols - messagelen) / 2;
+            if (padding) screen_put(y, 0, "~", 1, 0);
+            screen_put(y, padding, message, messagelen, 0);
+         } else {
+            screen_put(y, 0, "~", 1, 0);
+         }
+      } else {
+         int total_left_margin_size = num_digits(E.numrows) + LEFT_MARGIN_SIZE;
+         char linenum[32];
+         int linenumlen = snprintf(linenum, sizeof(linenum), "%*d%s", num_digits(E.numrows), (E.rowoff + y + 1), LEFT_MARGIN);
+         int x = 0;
+         if (E.show_line_numbers) x = screen_put(y, x, linenum, linenumlen, 36);
+
+         struct row_render * row = editor_row_refresh(filerow);
+         struct render_entry * e = editor_row_matches(filerow);
+         int len = row->rsize - E.coloff;
+         if (len < 0) len = 0;
          if (E.show_line_numbers) {
             if (len > E.screencols - total_left_margin_size) 
                len = E.screencols - total_left_margin_size;
@@ -272,43 +1580,39 @@ void editor_draw_rows(struct abuf * ab) {
             if (len > E.screencols)
                len = E.screencols;
          }
-         char * c = &E.row[filerow].render[E.coloff];
-         unsigned char * hl = &E.row[filerow].hl[E.coloff];
-         int current_color = -1;
-         int j;
-         for (j = 0; j < len; j++) {
-            if (iscntrl(c[j])) {
+         char * c = &row->render[E.coloff];
+         unsigned char * hl = &row->hl[E.coloff];
+         int color = 0;
+         int j = 0;
+         // search matches go over the syntax colours, a span at a time
+         int * span = e->spans;
+         int nspans = e->nspans;
+         int s = 0;
+         while (j < len) {
+            while (s < nspans && span[s * 2 + 1] - E.coloff <= j) s++;
+            int match = s < nspans && span[s * 2] - E.coloff <= j;
+            int edge = s == nspans ? len : span[s * 2 + match] - E.coloff;
+
+            // control characters show reversed, in the colour before them
+            if (is_control(c[j])) {
                char sym = (c[j] <= 26) ? '@' + c[j] : '?';
-               ab_append(ab, "\x1b[7m", 4);
-               ab_append(ab, &sym, 1);
-               ab_append(ab, "\x1b[m", 3);
-               if (current_color != -1) {
-                  char buf[16];
-                  int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", current_color);
-                  ab_append(ab, buf, clen);
-               }
-            } else if (hl[j] == HL_NORMAL) {
-               if (current_color != -1) {
-                  ab_append(ab, "\x1b[39m", 5);
-                  current_color = -1;
-               }
-               ab_append(ab, &c[j], 1);
-            } else {
-               int color = editor_syntax_to_color(hl[j]);
-               if (color != current_color) {
-                  current_color = color;
-                  char buf[16];
-                  int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", color);
-                  ab_append(ab, buf, clen);
-               }
-               ab_append(ab, &c[j], 1);
+               if (match) color = editor_syntax_to_color(HL_MATCH);
+               x = screen_put(y, x, &sym, 1, color | ATTR_REVERSE);
+               j++;
+               continue;
             }
+
+            // plain bytes sharing a highlight go in together
+            int run = render_plain_len(&c[j], (edge < len ? edge : len) - j);
+            int k = 1;
+            while (k < run && (match || hl[j + k] == hl[j])) k++;
+
+            if (match) color = editor_syntax_to_color(HL_MATCH);
+            else color = hl[j] == HL_NORMAL ? 0 : editor_syntax_to_color(hl[j]);
+            x = screen_put(y, x, &c[j], k, color);
+            j += k;
          }
-         ab_append(ab, "\x1b[39m", 5);
       }
-
-      ab_append(ab, "\x1b[K", 3);
-      ab_append(ab, "\r\n", 2);
    }
 }
 
@@ -326,64 +1630,112 @@ char * editor_mode_as_str()
    }
 }
 
-void editor_draw_status_bar(struct abuf * ab) 
+void editor_draw_status_bar() 
 {
-   ab_append(ab, "\x1b[7m", 4);
+   int y = E.screenrows;
+   for (int x = 0; x < E.screencols; x++) screen_put(y, x, " ", 1, ATTR_REVERSE);
 
    char status[80], rstatus[80];
    int len = snprintf(status, sizeof(status), " %s%s%.20s - %d lines %s",
       editor_mode_as_str(), LEFT_MARGIN,
       E.filename ? E.filename : "[No Name]", E.numrows,
       E.dirty ? "(modified)" : "");
-   int rlen = snprintf(rstatus, sizeof(rstatus), "%s | %d/%d",
+   // while searching, which match the cursor is on. a + means the
+   // count is still going up
+   char found[40] = "";
+   struct search_state * st = &E.search;
+   if (st->query && st->qlen > 0 && !st->kept) {
+      if (st->error)
+         snprintf(found, sizeof(found), "bad regex: %s | ", st->error);
+      else if (st->nmatches == 0)
+         snprintf(found, sizeof(found), "%s | ", st->running ? "searching" : "no matches");
+      else
+         snprintf(found, sizeof(found), "match %d of %d%s | ",
+               st->current + 1, st->nmatches, st->running ? "+" : "");
+   }
+   int rlen = snprintf(rstatus, sizeof(rstatus), "%s%s | %d/%d", found,
          E.syntax ? E.syntax->filetype : "no ft",
          E.cy + 1, E.numrows);
    if (len > E.screencols) len = E.screencols;
-   ab_append(ab, status, len);
+   len = screen_put(y, 0, status, len, ATTR_REVERSE);
 
-   while (len < E.screencols) {
-      if (E.screencols - len == rlen) {
-         ab_append(ab, rstatus, rlen);
-         break;
-      } else {
-         ab_append(ab, " ", 1);
-         len++;
-      }
-   }
-   ab_append(ab, "\x1b[m", 3);
-   ab_append(ab, "\r\n", 2);
+   if (len <= E.screencols - rlen)
+      screen_put(y, E.screencols - rlen, rstatus, rlen, ATTR_REVERSE);
 }
 
-void editor_draw_message_bar(struct abuf * ab)
+void editor_draw_message_bar()
 {
-   ab_append(ab, "\x1b[K", 3);
    int msglen = strlen(E.statusmsg);
    if (msglen > E.screencols) msglen = E.screencols;
    if (msglen && time(NULL) - E.statusmsg_time < 5)
-      ab_append(ab, E.statusmsg, msglen);
+      screen_put(E.screenrows + 1, 0, E.statusmsg, msglen, 0);
 }
 
-void editor_refresh_screen() {
-   editor_scroll();
-
-   struct abuf ab = ABUF_INIT;
-
-   ab_append(&ab, "\x1b[?25l", 6);
-   ab_append(&ab, "\x1b[H", 3);
+// synchronized update: terminals that know it show the frame all at once,
+// the rest ignore it
+#define SYNC_BEGIN "\x1b[?2026h"
+#define SYNC_END "\x1b[?2026l"
 
-   editor_draw_rows(&ab);
-   editor_draw_status_bar(&ab);
-   editor_draw_message_bar(&ab);
+/* writes as much of the frame in E.out as the terminal takes without
+ * blocking. once it has all gone, a frame that was held back meanwhile is
+ * drawn from the latest state */
+void editor_flush_output()
+{
+   while (E.out_sent < E.out.len) {
+      ssize_t n = write(E.out_fd, &E.out.b[E.out_sent], E.out.len - E.out_sent);
+      if (n > 0) E.out_sent += n;
+      else if (n == -1 && errno == EINTR) continue;
+      else return;
+   }
+   if (E.redraw_pending) editor_refresh_screen();
+}
 
-   char buf[32];
-   snprintf(buf, sizeof(buf), "\x1b[%d;%dH", (E.cy - E.rowoff) + 1,
-                                             (E.rx - E.coloff) + 1);
-   ab_append(&ab, buf, strlen(buf));
+// blocks until the last frame is out, before writing to the terminal
+// directly
+void editor_drain_output()
+{
+   while (E.out_sent < E.out.len) {
+      struct pollfd pfd = { E.out_fd, POLLOUT, 0 };
+      poll(&pfd, 1, -1);
+      ssize_t n = write(E.out_fd, &E.out.b[E.out_sent], E.out.len - E.out_sent);
+      if (n > 0) E.out_sent += n;
+      else if (n == -1 && errno != EAGAIN && errno != EINTR) break;
+   }
+}
 
-   ab_append(&ab, "\x1b[?25h", 6);
+/* while the terminal is still taking the last frame, new frames aren't
+ * queued up behind it: the redraw waits until it has drained and then
+ * draws whatever the state is by then, so a slow link skips frames rather
+ * than falling further and further behind the keyboard */
+void editor_refresh_screen() {
+   editor_scroll();
+   if (E.out_sent < E.out.len) {
+      E.redraw_pending = 1;
+      return;
+   }
+   E.redraw_pending = 0;
+
+   screen_resize();
+   screen_clear(E.frame, E.frame_odd);
+
+   editor_draw_rows();
+   editor_draw_status_bar();
+   editor_draw_message_bar();
+
+   struct abuf * ab = &E.out;
+   ab->len = 0;
+   ab_append(ab, SYNC_BEGIN, strlen(SYNC_BEGIN));
+   int changed = screen_flush(ab, E.rowoff - E.shadow_rowoff);
+   E.shadow_rowoff = E.rowoff;
+   screen_move(ab, E.rx - E.coloff, E.cy - E.rowoff);
+   if (changed) {
+      ab_append(ab, "\x1b[?25h", 6);
+      ab_append(ab, SYNC_END, strlen(SYNC_END));
+   }
 
-   write(STDOUT_FILENO, ab.b, ab.len);
-   ab_free(&ab);
+   // a frame that only moves the cursor goes out without the sync pair
+   E.out_sent = changed ? 0 : strlen(SYNC_BEGIN);
+   editor_flush_output();
 }
 
 void editor_set_status_message(const char * fmt, ...)
@@ -393,24 +1745,231 @@ void editor_set_status_message(const char * fmt, ...)
    vsnprintf(E.statusmsg, sizeof(E.statusmsg), fmt, ap);
    va_end(ap);
    E.statusmsg_time = time(NULL);
+   // the message is drawn for 5 seconds, a redraw takes it off again
+   editor_timer_set(editor_refresh_screen, 5000);
 }
 
-int editor_read_key() {
-   int nread;
-   char c;
-   while ((nread = read(STDIN_FILENO, &c, 1)) != 1) {
-      if (nread == -1 && errno != EAGAIN) die("read");
+long long editor_now_ms()
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+// (re)arms fn to run once in ms milliseconds
+void editor_timer_set(void (*fn)(), int ms)
+{
+   int slot = -1;
+   for (int i = 0; i < EDITOR_TIMERS; i++) {
+      if (E.timers[i].fn == fn) { slot = i; break; }
+      if (E.timers[i].fn == NULL && slot == -1) slot = i;
+   }
+   if (slot == -1) return;
+   E.timers[slot].fn = fn;
+   E.timers[slot].due = editor_now_ms() + ms;
+}
+
+// runs the timers that are due, and returns how long until the next one,
+// or -1 if none are set. a timer can set itself (or another) again as it
+// runs, into a slot already gone past, so the next one is looked for after
+int editor_timers_run()
+{
+   long long now = editor_now_ms();
+   for (int i = 0; i < EDITOR_TIMERS; i++) {
+      if (E.timers[i].fn == NULL || E.timers[i].due > now) continue;
+      void (*fn)() = E.timers[i].fn;
+      E.timers[i].fn = NULL;
+      fn();
+   }
+
+   long long next = -1;
+   for (int i = 0; i < EDITOR_TIMERS; i++) {
+      if (E.timers[i].fn == NULL) continue;
+      long long left = E.timers[i].due > now ? E.timers[i].due - now : 0;
+      if (next == -1 || left < next) next = left;
+   }
+   return next;
+}
+
+// whether highlighting still has rows to get through in the background
+int editor_idle_pending()
+{
+   return E.syntax && E.hl_valid < E.numrows;
+}
+
+// reads everything the terminal has sent so far onto the end of E.in.
+// returns how many bytes came in
+int editor_read_input()
+{
+   if (E.in_pos > 0) {
+      memmove(E.in, &E.in[E.in_pos], E.in_len - E.in_pos);
+      E.in_len -= E.in_pos;
+      E.in_pos = 0;
+   }
+
+   int total = 0;
+   while (E.in_len < INPUT_BUF_SIZE) {
+      int n = read(STDIN_FILENO, &E.in[E.in_len], INPUT_BUF_SIZE - E.in_len);
+      if (n == -1 && errno == EINTR) continue;
+      if (n == -1 && errno != EAGAIN) die("read");
+      if (n <= 0) break;
+      E.in_len += n;
+      total += n;
+   }
+   return total;
+}
+
+/* the one place the editor sleeps: in poll(), until input arrives, the
+ * terminal can take more of the last frame, or a timer is due. idle
+ * highlighting gets a step every IDLE_TICK_MS while it has rows left,
+ * and once it's done and no timer is set the editor sleeps until
+ * something happens */
+void editor_wait()
+{
+   for (;;) {
+      int timeout = editor_timers_run();
+      if (editor_idle_pending() && (timeout == -1 || timeout > IDLE_TICK_MS))
+         timeout = IDLE_TICK_MS;
+
+      struct pollfd fds[2] = {
+         { STDIN_FILENO, POLLIN, 0 },
+         { E.out_fd, POLLOUT, 0 }
+      };
+      int n = poll(fds, E.out_sent < E.out.len ? 2 : 1, timeout);
+      if (n == -1 && errno != EINTR) die("poll");
+      if (E.hangup) {
+         // the terminal went away: keep the edits, there's no one to ask
+         editor_journal_flush();
+         exit(1);
+      }
+
+      if (n > 0 && (fds[1].revents & (POLLOUT | POLLERR | POLLHUP))) editor_flush_output();
+      if (n > 0 && (fds[0].revents & (POLLIN | POLLERR | POLLHUP))) {
+         if (editor_read_input() > 0) return;
+         if (fds[0].revents & (POLLERR | POLLHUP)) die("read");
+      }
+      if (n == 0 && editor_idle_pending()) editor_idle();
+   }
+}
+
+// whether keys are waiting to be handled before the next frame
+int editor_key_pending()
+{
+   return E.in_pos < E.in_len;
+}
+
+// waits up to ms for more input. returns how many bytes came
+int editor_input_wait(int ms)
+{
+   struct pollfd pfd = { STDIN_FILENO, POLLIN, 0 };
+   int n;
+   while ((n = poll(&pfd, 1, ms)) == -1 && errno == EINTR && !E.hangup);
+   if (n <= 0) return 0;
+   return editor_read_input();
+}
+
+// waits a moment for the rest of a sequence. returns how many bytes came
+int editor_input_more()
+{
+   return editor_input_wait(ESC_TIMEOUT_MS);
+}
+
+// the next byte of input, taken off E.in. the rest of an escape sequence
+// is waited for a moment; -1 if it doesn't come
+int editor_input_next()
+{
+   while (E.in_pos >= E.in_len) {
+      if (editor_input_more() == 0) return -1;
+   }
+   return (unsigned char)E.in[E.in_pos++];
+}
+
+/* parses the "button;x;yM" that follows "\x1b[<" in a mouse report.
+ * returns the bytes it took, 0 if s ends before the report does, or -1
+ * if it isn't one */
+int mouse_parse(const char * s, int n, int * button, int * x, int * y, int * press)
+{
+   int v[3] = {0, 0, 0};
+   int field = 0;
+   for (int i = 0; i < n; i++) {
+      char c = s[i];
+      if (c >= '0' && c <= '9') {
+         v[field] = v[field] * 10 + (c - '0');
+      } else if (c == ';' && field < 2) {
+         field++;
+      } else if ((c == 'M' || c == 'm') && field == 2) {
+         *button = v[0];
+         *x = v[1];
+         *y = v[2];
+         *press = c == 'M';
+         return i + 1;
+      } else {
+         return -1;
+      }
+   }
+   return 0;
+}
+
+/* reads a mouse report, "\x1b[<" already taken, into E.mouse. wheel
+ * reports right behind it in the input are folded into the same scroll,
+ * so a fast wheel costs one scroll and one frame however many reports
+ * the terminal sends */
+int editor_read_mouse()
+{
+   int button, x, y, press, n;
+   while ((n = mouse_parse(&E.in[E.in_pos], E.in_len - E.in_pos, &button, &x, &y, &press)) == 0) {
+      if (E.in_len - E.in_pos >= MOUSE_REPORT_MAX || editor_input_more() == 0) return '\x1b';
    }
+   if (n < 0) return '\x1b';
+   E.in_pos += n;
+
+   E.mouse.scroll = 0;
+   E.mouse.click = 0;
+   for (;;) {
+      // the shift, meta and control bits don't matter here
+      button &= ~(4 | 8 | 16);
+      if (button == 64 || button == 65) {
+         E.mouse.scroll += button == 64 ? -WHEEL_ROWS : WHEEL_ROWS;
+      } else if (button == 0 && press) {
+         E.mouse.click = 1;
+         E.mouse.x = x - 1;
+         E.mouse.y = y - 1;
+      }
+      if (button != 64 && button != 65) break;
+
+      const char * next = &E.in[E.in_pos];
+      int avail = E.in_len - E.in_pos;
+      if (avail < 3 || memcmp(next, "\x1b[<", 3) != 0) break;
+      n = mouse_parse(next + 3, avail - 3, &button, &x, &y, &press);
+      if (n <= 0 || (button & ~(4 | 8 | 16)) < 64 || (button & ~(4 | 8 | 16)) > 65) break;
+      E.in_pos += 3 + n;
+   }
+   return MOUSE_EVENT;
+}
+
+int editor_read_key() {
+   while (!editor_key_pending()) editor_wait();
+   char c = E.in[E.in_pos++];
 
    if (c == '\x1b') {
-      char seq[3];
+      int seq[3];
 
-      if (read(STDIN_FILENO, &seq[0], 1) != 1) return '\x1b';
-      if (read(STDIN_FILENO, &seq[1], 1) != 1) return '\x1b';
+      if ((seq[0] = editor_input_next()) == -1) return '\x1b';
+      if ((seq[1] = editor_input_next()) == -1) return '\x1b';
 
       if (seq[0] == '[') {
          if (seq[1] >= '0' && seq[1] <= '9') {
-            if (read(STDIN_FILENO, &seq[2], 1) != 1) return '\x1b';
+            if ((seq[2] = editor_input_next()) == -1) return '\x1b';
+            if (seq[2] >= '0' && seq[2] <= '9') {
+               int num = (seq[1] - '0') * 10 + (seq[2] - '0');
+               int d;
+               while ((d = editor_input_next()) >= '0' && d <= '9')
+                  num = num * 10 + (d - '0');
+               if (d == '~' && num == 200) return PASTE_START;
+               // the end of a paste that was given up on
+               if (d == '~' && num == 201) return PASTE_STRAY_END;
+               return '\x1b';
+            }
             if (seq[2] == '~') {
                switch (seq[1]) {
                   case '1': return HOME_KEY;
@@ -422,12 +1981,9 @@ int editor_read_key() {
                   case '8': return END_KEY;
                }
             }
-         } else if (seq[1] == '<') {	
-				switch (seq[3]) {	
-					case '5': return ARROW_UP;	
-					case '4': return ARROW_DOWN;	
-				}	
-			} else {
+         } else if (seq[1] == '<') {
+            return editor_read_mouse();
+         } else {
             switch (seq[1]) {
                case 'A': return ARROW_UP;
                case 'B': return ARROW_DOWN;
@@ -450,6 +2006,43 @@ int editor_read_key() {
    }
 }
 
+/* collects a bracketed paste, whose start has already been read, up to
+ * its end marker. returns the text malloc'd, with its length in len. if
+ * the terminal sends nothing for PASTE_TIMEOUT_MS before the end marker,
+ * what came is kept */
+char * editor_read_paste(int * len)
+{
+   struct abuf ab = ABUF_INIT;
+   int endlen = strlen(PASTE_END);
+   for (;;) {
+      char * in = &E.in[E.in_pos];
+      int avail = E.in_len - E.in_pos;
+      char * end = memmem(in, avail, PASTE_END, endlen);
+      if (end) {
+         ab_append(&ab, in, end - in);
+         E.in_pos += end - in + endlen;
+         break;
+      }
+
+      // keep back what could be the start of a split end marker
+      int take = avail - (endlen - 1);
+      if (take > 0) {
+         ab_append(&ab, in, take);
+         E.in_pos += take;
+      }
+
+      if (editor_input_wait(PASTE_TIMEOUT_MS) == 0) {
+         ab_append(&ab, &E.in[E.in_pos], E.in_len - E.in_pos);
+         E.in_pos = E.in_len;
+         break;
+      }
+   }
+   ab_reserve(&ab, 1);
+   ab.b[ab.len] = '\0';
+   *len = ab.len;
+   return ab.b;
+}
+
 int get_cursor_position(int *rows, int *cols)
 {
    char buf[32];
@@ -458,6 +2051,8 @@ int get_cursor_position(int *rows, int *cols)
    if (write(STDOUT_FILENO, "\x1b[6n", 4) != 4) return -1;
 
    while (i < sizeof(buf) - 1) {
+      struct pollfd pfd = { STDIN_FILENO, POLLIN, 0 };
+      if (poll(&pfd, 1, ESC_TIMEOUT_MS) <= 0) break;
       if (read(STDIN_FILENO, &buf[i], 1) != 1) break;
       if (buf[i] == 'R') break;
       i++;
@@ -489,502 +2084,3405 @@ int is_separator(int c)
    return isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[];", c) != NULL;
 }
 
-void editor_update_syntax(erow * row)
+/* a syntax's keywords compiled into an open addressing hash table of whole
+ * words, so looking a word up costs one hash however many keywords the
+ * syntax has. words that can't be keywords are mostly turned away before
+ * hashing by their first byte and length */
+struct keyword {
+   char * word;
+   int len;
+   int hl;
+};
+
+struct keyword_table {
+   struct keyword * slots;
+   unsigned int mask;
+   int min_len, max_len;
+   unsigned char first[256];
+};
+
+unsigned int keyword_hash(const char * s, int len)
+{
+   unsigned int h = 2166136261u;
+   for (int i = 0; i < len; i++) h = (h ^ (unsigned char)s[i]) * 16777619u;
+   return h;
+}
+
+// keywords ending in '|' are KEYWORD2, the rest KEYWORD1
+struct keyword_table * keyword_table_build(char ** keywords)
+{
+   int count = 0;
+   while (keywords[count]) count++;
+
+   struct keyword_table * t = calloc(1, sizeof(struct keyword_table));
+   unsigned int size = 16;
+   while (size < (unsigned int)count * 2) size *= 2;
+   t->slots = calloc(size, sizeof(struct keyword));
+   t->mask = size - 1;
+   t->min_len = 0;
+   t->max_len = 0;
+
+   for (int j = 0; j < count; j++) {
+      int len = strlen(keywords[j]);
+      int kw2 = len > 0 && keywords[j][len - 1] == '|';
+      if (kw2) len--;
+      if (len == 0) continue;
+
+      // the first of any duplicates wins, as it did with a linear scan
+      unsigned int h = keyword_hash(keywords[j], len) & t->mask;
+      while (t->slots[h].word && (t->slots[h].len != len ||
+               strncmp(t->slots[h].word, keywords[j], len)))
+         h = (h + 1) & t->mask;
+      if (t->slots[h].word) continue;
+
+      t->slots[h].word = keywords[j];
+      t->slots[h].len = len;
+      t->slots[h].hl = kw2 ? HL_KEYWORD2 : HL_KEYWORD1;
+      t->first[(unsigned char)keywords[j][0]] = 1;
+      if (t->min_len == 0 || len < t->min_len) t->min_len = len;
+      if (len > t->max_len) t->max_len = len;
+   }
+   return t;
+}
+
+/* a syntax compiled into byte class tables. every byte value maps to
+ * the set of things it can start, so the highlighter only tries to match a
+ * delimiter or keyword at bytes that could begin one, and runs of plain
+ * text, strings and block comments are stepped over without any probing */
+#define LEX_SEP     (1<<0)
+#define LEX_DIGIT   (1<<1)
+#define LEX_DOT     (1<<2)
+#define LEX_QUOTE   (1<<3)
+#define LEX_SCS     (1<<4)
+#define LEX_MCS     (1<<5)
+#define LEX_KEYWORD (1<<6)
+
+struct syntax_lexer {
+   unsigned char cls[256];
+   struct keyword_table * keywords;
+   char * scs, * mcs, * mce;
+   int scs_len, mcs_len, mce_len;
+};
+
+struct syntax_lexer * syntax_compile(struct editor_syntax * s)
+{
+   struct syntax_lexer * lex = calloc(1, sizeof(struct syntax_lexer));
+   if (lex == NULL) die("calloc");
+
+   lex->keywords = keyword_table_build(s->keywords);
+   lex->scs = s->singleline_comment_start;
+   lex->mcs = s->multiline_comment_start;
+   lex->mce = s->multiline_comment_end;
+   lex->scs_len = lex->scs ? strlen(lex->scs) : 0;
+   lex->mcs_len = lex->mcs ? strlen(lex->mcs) : 0;
+   lex->mce_len = lex->mce ? strlen(lex->mce) : 0;
+
+   // block comments need both ends to be any use
+   if (!lex->mcs_len || !lex->mce_len) lex->mcs_len = lex->mce_len = 0;
+
+   for (int c = 0; c < 256; c++) {
+      if (is_separator(c)) lex->cls[c] |= LEX_SEP;
+      if (lex->keywords->first[c]) lex->cls[c] |= LEX_KEYWORD;
+   }
+
+   if (s->flags & HL_HIGHLIGHT_NUMBERS) {
+      for (int c = '0'; c <= '9'; c++) lex->cls[c] |= LEX_DIGIT;
+      lex->cls['.'] |= LEX_DOT;
+   }
+   if (s->flags & HL_HIGHLIGHT_STRINGS) {
+      char * q = s->string_delimiters ? s->string_delimiters : "\"'";
+      for (; *q; q++) lex->cls[(unsigned char)*q] |= LEX_QUOTE;
+   }
+   if (lex->scs_len) lex->cls[(unsigned char)lex->scs[0]] |= LEX_SCS;
+   if (lex->mcs_len) lex->cls[(unsigned char)lex->mcs[0]] |= LEX_MCS;
+
+   return lex;
+}
+
+// length of the keyword starting at s (bounded by end), or 0 if the word
+// there isn't one. its highlight class goes in *hl
+int lexer_keyword(struct syntax_lexer * lex, const char * s, const char * end, int * hl)
+{
+   struct keyword_table * t = lex->keywords;
+
+   int len = 0;
+   while (s + len < end && len <= t->max_len &&
+         !(lex->cls[(unsigned char)s[len]] & LEX_SEP)) len++;
+   if (len < t->min_len || len > t->max_len) return 0;
+
+   unsigned int h = keyword_hash(s, len) & t->mask;
+   while (t->slots[h].word) {
+      if (t->slots[h].len == len && !memcmp(t->slots[h].word, s, len)) {
+         *hl = t->slots[h].hl;
+         return len;
+      }
+      h = (h + 1) & t->mask;
+   }
+   return 0;
+}
+
+// whether the delimiter d of length len starts at s, bounded by end
+static inline int lexer_at(const char * s, const char * end, const char * d, int len)
 {
-   row->hl = realloc(row->hl, row->rsize);
-   memset(row->hl, HL_NORMAL, row->rsize);
+   return end - s >= len && !memcmp(s, d, len);
+}
 
-   if (E.syntax == NULL) return;
+// highlights r as if a block comment were open at its start when
+// in_comment is set. returns whether one is still open at its end. only
+// touches r itself, so it's safe to run on several rows at once
+int editor_syntax_row(struct row_render * r, int in_comment)
+{
+   if (r->rsize >= r->hlcap) {
+      r->hlcap = r->rsize >= r->hlcap * 2 ? r->rsize + 1 : r->hlcap * 2;
+      r->hl = realloc(r->hl, r->hlcap);
+   }
+   memset(r->hl, HL_NORMAL, r->rsize);
 
-   char ** keywords = E.syntax->keywords;
+   if (E.syntax == NULL) return 0;
 
-   char * scs = E.syntax->singleline_comment_start;
-   char * mcs = E.syntax->multiline_comment_start;
-   char * mce = E.syntax->multiline_comment_end;
+   struct syntax_lexer * lex = E.syntax->lexer;
+   const unsigned char * cls = lex->cls;
+   char * render = r->render;
+   char * end = &render[r->rsize];
+   unsigned char * hl = r->hl;
+   int len = r->rsize;
 
-   int scs_len = scs ? strlen(scs) : 0;
-   int mcs_len = mcs ? strlen(mcs) : 0;
-   int mce_len = mce ? strlen(mce) : 0;
+   if (!lex->mce_len) in_comment = 0;
 
    int prev_sep = 1;
    int in_string = 0;
-   int in_comment = (row->idx > 0 && E.row[row->idx - 1].hl_open_comment);
 
    int i = 0;
-   while (i < row->rsize) {
-      char c = row->render[i];
-      unsigned char prev_hl = (i > 0) ? row->hl[i - 1] : HL_NORMAL;
-
-      if (scs_len && !in_string && !in_comment) {
-         if (!strncmp(&row->render[i], scs, scs_len)) {
-            memset(&row->hl[i], HL_COMMENT, row->rsize - i);
+   while (i < len) {
+      if (in_comment) {
+         // jump to the next place the comment could end
+         char * p = &render[i];
+         while ((p = memchr(p, lex->mce[0], end - p)) &&
+               !lexer_at(p, end, lex->mce, lex->mce_len)) p++;
+
+         if (p == NULL) {
+            memset(&hl[i], HL_MLCOMMENT, len - i);
             break;
          }
+         int stop = p - render + lex->mce_len;
+         memset(&hl[i], HL_MLCOMMENT, stop - i);
+         i = stop;
+         in_comment = 0;
+         prev_sep = 1;
+         continue;
       }
 
-      if (mcs_len && mce_len && !in_string) {
-         if (in_comment) {
-            row->hl[i] = HL_MLCOMMENT;
-            if (!strncmp(&row->render[i], mce, mce_len)) {
-               memset(&row->hl[i], HL_MLCOMMENT, mce_len);
-               i += mce_len;
-               in_comment = 0;
-               prev_sep = 1;
-               continue;
-            } else {
-               i++;
-               continue;
-            }
-         } else if (!strncmp(&row->render[i], mcs, mcs_len)) {
-            memset(&row->hl[i], HL_MLCOMMENT, mcs_len);
-            i += mcs_len;
-            in_comment = 1;
+      if (in_string) {
+         char c = render[i];
+         hl[i] = HL_STRING;
+         if (c == '\\' && i + 1 < len) {
+            hl[i + 1] = HL_STRING;
+            i += 2;
             continue;
          }
+         if (c == in_string) in_string = 0;
+         i++;
+         prev_sep = 1;
+         continue;
       }
 
-      if (E.syntax->flags & HL_HIGHLIGHT_STRINGS) {
-         if (in_string) {
-            row->hl[i] = HL_STRING;
-            if (c == '\\' && i + 1 < row->rsize) {
-               row->hl[i + 1] = HL_STRING;
-               i += 2;
-               continue;
-            }
-            if (c == in_string) in_string = 0;
-            i++;
-            prev_sep = 1;
-            continue;
-         } else {
-            if (c == '"' || c == '\'') {
-               in_string = c;
-               row->hl[i] = HL_STRING;
-               i++;
-               continue;
-            }
-         }
+      unsigned char c = render[i];
+      int k = cls[c];
+
+      // plain text: nothing can start here, and it isn't a separator
+      if (k == 0 || (k == LEX_KEYWORD && !prev_sep)) {
+         prev_sep = 0;
+         i++;
+         continue;
       }
 
-      if (E.syntax->flags & HL_HIGHLIGHT_NUMBERS) {
-         if ((isdigit(c) && (prev_sep || prev_hl == HL_NUMBER)) ||
-               (c == '.' && prev_hl == HL_NUMBER)) {
-            row->hl[i] = HL_NUMBER;
-            i++;
-            prev_sep = 0;
-            continue;
-         }
+      if ((k & LEX_SCS) && lexer_at(&render[i], end, lex->scs, lex->scs_len)) {
+         memset(&hl[i], HL_COMMENT, len - i);
+         break;
       }
 
-      if (prev_sep) {
-         int j;
-         for (j = 0; keywords[j]; j++) {
-            int klen = strlen(keywords[j]);
-            int kw2 = keywords[j][klen - 1] == '|';
-            if (kw2) klen--;
+      if ((k & LEX_MCS) && lexer_at(&render[i], end, lex->mcs, lex->mcs_len)) {
+         memset(&hl[i], HL_MLCOMMENT, lex->mcs_len);
+         i += lex->mcs_len;
+         in_comment = 1;
+         continue;
+      }
 
-            if (!strncmp(&row->render[i], keywords[j], klen) &&
-                  is_separator(row->render[i + klen])) {
-               memset(&row->hl[i], kw2 ? HL_KEYWORD2 : HL_KEYWORD1, klen);
-               i += klen;
-               break;
-            }
-         }
+      if (k & LEX_QUOTE) {
+         in_string = (char)c;
+         hl[i] = HL_STRING;
+         i++;
+         continue;
+      }
+
+      unsigned char prev_hl = (i > 0) ? hl[i - 1] : HL_NORMAL;
+      if (((k & LEX_DIGIT) && (prev_sep || prev_hl == HL_NUMBER)) ||
+            ((k & LEX_DOT) && prev_hl == HL_NUMBER)) {
+         hl[i] = HL_NUMBER;
+         i++;
+         prev_sep = 0;
+         continue;
+      }
 
-         if (keywords[j] != NULL) {
+      if (prev_sep && (k & LEX_KEYWORD)) {
+         int kw;
+         int klen = lexer_keyword(lex, &render[i], end, &kw);
+         if (klen) {
+            memset(&hl[i], kw, klen);
+            i += klen;
             prev_sep = 0;
             continue;
          }
       }
 
-      prev_sep = is_separator(c);
+      prev_sep = (k & LEX_SEP) != 0;
       i++;
    }
 
-   int changed = (row->hl_open_comment != in_comment);
-   row->hl_open_comment = in_comment;
-   if (changed && row->idx + 1 < E.numrows) {
-      editor_update_syntax(&E.row[row->idx + 1]);
+   return in_comment;
+}
+
+/* part of a run of rows being checked for highlighting, given to one
+ * thread. it covers rows from..to of its first and last leaf (all rows of
+ * the leaves in between). start is the comment state the chunk is guessed
+ * to begin in and end is the state it was left in */
+struct hl_chunk {
+   struct row_node ** leaves;
+   int nleaves;
+   int from, to;
+   int start, end;
+   struct row_render scratch;
+};
+
+// highlights a lazy leaf straight from the map, keeping only the states
+// at its start and end. lazy leaves are always done whole
+int editor_hl_lazy_leaf(struct row_node * leaf, int state, struct row_render * scratch)
+{
+   leaf->hl_start = state;
+   for (int i = 0; i < leaf->n; i++) {
+      int len;
+      char * line = editor_map_line(leaf->u.offs[i], leaf->u.offs[i + 1], &len);
+      editor_render_text(scratch, line, len, NULL, 0);
+      state = editor_syntax_row(scratch, state);
    }
+   leaf->hl_open_comment = state;
+   leaf->hl_done = 1;
+   return state;
 }
 
-void editor_select_syntax_highlight()
+void * hl_chunk_run(void * arg)
 {
+   struct hl_chunk * chunk = arg;
+   int state = chunk->start;
+   for (int l = 0; l < chunk->nleaves; l++) {
+      struct row_node * leaf = chunk->leaves[l];
+      if (leaf->lazy) {
+         if (leaf->hl_done && leaf->hl_start == state) state = leaf->hl_open_comment;
+         else state = editor_hl_lazy_leaf(leaf, state, &chunk->scratch);
+         continue;
+      }
+
+      int from = l == 0 ? chunk->from : 0;
+      int to = l == chunk->nleaves - 1 ? chunk->to : leaf->n;
+      for (int i = from; i < to; i++) {
+         // rows that were highlighted from this same state are still right
+         erow * row = &leaf->u.rows[i];
+         if (!row->stale && row->hl_start == state) {
+            state = row->hl_open_comment;
+            continue;
+         }
+         state = editor_hl_row(row, state, &chunk->scratch);
+      }
+   }
+   chunk->end = state;
+   return NULL;
+}
+
+// redoes a chunk from its real start state, stopping at the first row that
+// was already highlighted from the state it now starts in, since nothing
+// after it changes
+void hl_chunk_fix(struct hl_chunk * chunk, int state)
+{
+   for (int l = 0; l < chunk->nleaves; l++) {
+      struct row_node * leaf = chunk->leaves[l];
+      if (leaf->lazy) {
+         if (leaf->hl_start == state) return;
+         state = editor_hl_lazy_leaf(leaf, state, &chunk->scratch);
+         continue;
+      }
+
+      int from = l == 0 ? chunk->from : 0;
+      int to = l == chunk->nleaves - 1 ? chunk->to : leaf->n;
+      for (int i = from; i < to; i++) {
+         erow * row = &leaf->u.rows[i];
+         if (row->hl_start == state) return;
+         state = editor_hl_row(row, state, &chunk->scratch);
+      }
+   }
+   chunk->end = state;
+}
+
+/* checks a run of rows starting in comment state `state`: rows from.. of
+ * the first leaf up to row `to` (exclusive) of the last. long runs are
+ * split into one chunk per core. every chunk but the first guesses it
+ * doesn't start inside a block comment, and chunks whose guess turns out
+ * wrong are fixed up afterwards, in order */
+void editor_highlight_leaves(struct row_node ** leaves, int nleaves, int from, int to, int state)
+{
+   int rows = 0;
+   for (int l = 0; l < nleaves; l++) rows += leaves[l]->n;
+
+   int cpus = editor_cpus();
+   int nchunks = rows / HL_CHUNK_MIN + 1;
+   if (nchunks > cpus) nchunks = cpus;
+   if (nchunks > HL_CHUNK_THREADS) nchunks = HL_CHUNK_THREADS;
+   if (nchunks > nleaves) nchunks = nleaves;
+
+   struct hl_chunk chunks[HL_CHUNK_THREADS];
+   pthread_t threads[HL_CHUNK_THREADS];
+   int started[HL_CHUNK_THREADS];
+   int c;
+   for (c = 0; c < nchunks; c++) {
+      int first = (long long)nleaves * c / nchunks;
+      int last = (long long)nleaves * (c + 1) / nchunks;
+      chunks[c].leaves = &leaves[first];
+      chunks[c].nleaves = last - first;
+      chunks[c].from = c == 0 ? from : 0;
+      chunks[c].to = c == nchunks - 1 ? to : leaves[last - 1]->n;
+      chunks[c].start = c == 0 ? state : 0;
+      memset(&chunks[c].scratch, 0, sizeof(struct row_render));
+   }
+   // the first chunk runs on this thread, and keeps its scratch buffer
+   // between calls so highlighting a row or two per frame allocates nothing
+   static struct row_render scratch = { NULL, 0, 0, NULL, 0 };
+   chunks[0].scratch = scratch;
+   for (c = 1; c < nchunks; c++)
+      started[c] = pthread_create(&threads[c], NULL, hl_chunk_run, &chunks[c]) == 0;
+   hl_chunk_run(&chunks[0]);
+   for (c = 1; c < nchunks; c++) {
+      if (started[c]) pthread_join(threads[c], NULL);
+      else hl_chunk_run(&chunks[c]);
+   }
+
+   for (c = 1; c < nchunks; c++) {
+      if (chunks[c].start != chunks[c - 1].end)
+         hl_chunk_fix(&chunks[c], chunks[c - 1].end);
+   }
+   scratch = chunks[0].scratch;
+   for (c = 1; c < nchunks; c++) row_render_free(&chunks[c].scratch);
+}
+
+void syntax_list_push(char *** list, int * n, char * item)
+{
+   *list = realloc(*list, sizeof(char *) * (*n + 2));
+   (*list)[(*n)++] = item;
+   (*list)[*n] = NULL;
+}
+
+/* reads a syntax definition. each line is a key followed by words split
+ * on whitespace, and lines starting with # are ignored:
+ *
+ *    filetype haskell
+ *    filematch .hs
+ *    keywords module import where let in if then else case of data
+ *    types Int Bool String Maybe
+ *    comment --
+ *    multiline_comment {- -}
+ *    strings "
+ *    numbers
+ *
+ * returns NULL if the file can't be read or names no filetype or files */
+struct editor_syntax * syntax_load(const char * path)
+{
+   FILE * fp = fopen(path, "r");
+   if (!fp) return NULL;
+
+   struct editor_syntax * s = calloc(1, sizeof(struct editor_syntax));
+   int nmatch = 0, nkeywords = 0;
+   const char * ws = " \t\r\n";
+
+   char * line = NULL;
+   size_t linecap = 0;
+   while (getline(&line, &linecap, fp) != -1) {
+      char * key = strtok(line, ws);
+      if (key == NULL || key[0] == '#') continue;
+
+      char * arg;
+      if (!strcmp(key, "filetype")) {
+         if ((arg = strtok(NULL, ws))) {
+            free(s->filetype);
+            s->filetype = strdup(arg);
+         }
+      } else if (!strcmp(key, "filematch")) {
+         while ((arg = strtok(NULL, ws)))
+            syntax_list_push(&s->filematch, &nmatch, strdup(arg));
+      } else if (!strcmp(key, "keywords")) {
+         while ((arg = strtok(NULL, ws)))
+            syntax_list_push(&s->keywords, &nkeywords, strdup(arg));
+      } else if (!strcmp(key, "types")) {
+         // stored with a trailing '|' like the built in KEYWORD2s
+         while ((arg = strtok(NULL, ws))) {
+            char * kw = malloc(strlen(arg) + 2);
+            sprintf(kw, "%s|", arg);
+            syntax_list_push(&s->keywords, &nkeywords, kw);
+         }
+      } else if (!strcmp(key, "comment")) {
+         if ((arg = strtok(NULL, ws))) {
+            free(s->singleline_comment_start);
+            s->singleline_comment_start = strdup(arg);
+         }
+      } else if (!strcmp(key, "multiline_comment")) {
+         char * start = strtok(NULL, ws);
+         char * end = strtok(NULL, ws);
+         if (start && end) {
+            free(s->multiline_comment_start);
+            free(s->multiline_comment_end);
+            s->multiline_comment_start = strdup(start);
+            s->multiline_comment_end = strdup(end);
+         }
+      } else if (!strcmp(key, "strings")) {
+         s->flags |= HL_HIGHLIGHT_STRINGS;
+         if ((arg = strtok(NULL, ws))) {
+            free(s->string_delimiters);
+            s->string_delimiters = strdup(arg);
+         }
+      } else if (!strcmp(key, "numbers")) {
+         s->flags |= HL_HIGHLIGHT_NUMBERS;
+      }
+   }
+   free(line);
+   fclose(fp);
+
+   if (s->keywords == NULL) syntax_list_push(&s->keywords, &nkeywords, NULL);
+
+   if (s->filetype == NULL || s->filematch == NULL) {
+      for (int i = 0; i < nmatch; i++) free(s->filematch[i]);
+      for (int i = 0; i < nkeywords; i++) free(s->keywords[i]);
+      free(s->filematch);
+      free(s->keywords);
+      free(s->filetype);
+      free(s->singleline_comment_start);
+      free(s->multiline_comment_start);
+      free(s->multiline_comment_end);
+      free(s->string_delimiters);
+      free(s);
+      return NULL;
+   }
+   return s;
+}
+
+// reads every *.syntax file in $YAR_SYNTAX_DIR, or ~/.config/yar/syntax
+// when that isn't set. done once, the first time a file is opened
+void editor_load_syntaxes()
+{
+   if (E.syntaxes_loaded) return;
+   E.syntaxes_loaded = 1;
+
+   char dir[1024];
+   char * env = getenv("YAR_SYNTAX_DIR");
+   char * home = getenv("HOME");
+   if (env && *env) snprintf(dir, sizeof(dir), "%s", env);
+   else if (home) snprintf(dir, sizeof(dir), "%s/.config/yar/syntax", home);
+   else return;
+
+   // in name order, so which of two files claiming an extension wins
+   // doesn't depend on the filesystem
+   struct dirent ** ents;
+   int n = scandir(dir, &ents, NULL, alphasort);
+   if (n < 0) return;
+
+   for (int i = 0; i < n; i++) {
+      char * name = ents[i]->d_name;
+      int len = strlen(name);
+      char path[2048];
+      struct editor_syntax * s = NULL;
+
+      if (len > 7 && !strcmp(&name[len - 7], ".syntax")) {
+         snprintf(path, sizeof(path), "%s/%s", dir, name);
+         s = syntax_load(path);
+      }
+      free(ents[i]);
+      if (s == NULL) continue;
+
+      E.syntaxes = realloc(E.syntaxes, sizeof(struct editor_syntax *) * (E.num_syntaxes + 1));
+      E.syntaxes[E.num_syntaxes++] = s;
+   }
+   free(ents);
+}
+
+int syntax_matches(struct editor_syntax * s, char * filename)
+{
+   char * ext = strrchr(filename, '.');
+
+   for (unsigned int i = 0; s->filematch[i]; i++) {
+      int is_ext = (s->filematch[i][0] == '.');
+      if ((is_ext && ext && !strcmp(ext, s->filematch[i])) ||
+            (!is_ext && strstr(filename, s->filematch[i])))
+         return 1;
+   }
+   return 0;
+}
+
+// every row gets re-highlighted as it's drawn, lazy rows without being
+// loaded
+void editor_rows_invalidate()
+{
+   struct row_node * leaf;
+   for (leaf = row_tree_first_leaf(); leaf; leaf = row_leaf_next(leaf)) {
+      if (leaf->lazy) leaf->hl_done = 0;
+      else for (int k = 0; k < leaf->n; k++) leaf->u.rows[k].stale = 1;
+   }
+   E.hl_valid = 0;
+   E.render_gen++;
+}
+
+void editor_select_syntax_highlight()
+{
+   editor_rows_invalidate();
+
    E.syntax = NULL;
    if (E.filename == NULL) return;
 
-   char * ext = strrchr(E.filename, '.');
+   editor_load_syntaxes();
 
-   for (unsigned int j = 0; j < HLDB_ENTRIES; j++) {
-      struct editor_syntax * s = &HLDB[j];
-      unsigned int i = 0;
+   // definitions read from files take precedence over the built in ones
+   struct editor_syntax * s = NULL;
+   for (int j = 0; j < E.num_syntaxes && s == NULL; j++)
+      if (syntax_matches(E.syntaxes[j], E.filename)) s = E.syntaxes[j];
+   for (unsigned int j = 0; j < HLDB_ENTRIES && s == NULL; j++)
+      if (syntax_matches(&HLDB[j], E.filename)) s = &HLDB[j];
+   if (s == NULL) return;
 
-      while (s->filematch[i]) {
-         int is_ext = (s->filematch[i][0] == '.');
-         if ((is_ext && ext && !strcmp(ext, s->filematch[i])) ||
-               (!is_ext && strstr(E.filename, s->filematch[i]))) {
-            E.syntax = s;
+   if (s->lexer == NULL) s->lexer = syntax_compile(s);
+   E.syntax = s;
+}
 
-            int filerow;
-            for (filerow = 0; filerow < E.numrows; filerow++) {
-               editor_update_syntax(&E.row[filerow]);
-            }
+// makes sure render can take need more bytes after its first used
+void editor_render_reserve(struct row_render * r, int used, int need)
+{
+   if (used + need <= r->rcap) return;
+   int cap = r->rcap * 2;
+   if (cap < used + need) cap = used + need;
+   r->render = realloc(r->render, cap);
+   r->rcap = cap;
+}
 
-            return;
+void row_render_free(struct row_render * r)
+{
+   free(r->render);
+   free(r->hl);
+}
+
+/* expands the tabs of the text s0 followed by s1 into r in a single pass.
+ * the runs between control characters are found a block at a time and
+ * copied whole, and render is only grown when the tabs need more room
+ * than it already has */
+void editor_render_text(struct row_render * r, const char * s0, int n0, const char * s1, int n1)
+{
+   const char * seg[2] = { s0, s1 };
+   int seglen[2] = { n0, n1 };
+
+   editor_render_reserve(r, 0, n0 + n1 + 1);
+
+   int idx = 0;
+   int left = n0 + n1;
+   for (int s = 0; s < 2; s++) {
+      const char * p = seg[s];
+      int n = seglen[s];
+      while (n > 0) {
+         int run = render_plain_len(p, n);
+         memcpy(&r->render[idx], p, run);
+         idx += run;
+         p += run;
+         n -= run;
+         left -= run;
+         if (n == 0) break;
+
+         if (*p == '\t') {
+            int spaces = E.tab_stop - idx % E.tab_stop;
+            editor_render_reserve(r, idx, spaces + left);
+            memset(&r->render[idx], ' ', spaces);
+            idx += spaces;
+         } else {
+            r->render[idx++] = *p;
          }
-         i++;
+         p++;
+         n--;
+         left--;
+      }
+   }
+   r->render[idx] = '\0';
+   r->rsize = idx;
+}
+
+// the text is read around the gap, render never needs it contiguous
+void editor_render_row(erow * row, struct row_render * r)
+{
+   editor_render_text(r, row->chars, row->gap,
+         &row->chars[row->gap + row->gaplen], row->size - row->gap);
+}
+
+// re-highlights row from state in scratch, keeping only its comment states
+int editor_hl_row(erow * row, int state, struct row_render * scratch)
+{
+   editor_render_row(row, scratch);
+   row->hl_start = state;
+   row->stale = 0;
+   return row->hl_open_comment = editor_syntax_row(scratch, state);
+}
+
+void render_cache_unlink(int slot)
+{
+   struct render_entry * e = &E.rcache[slot];
+   if (e->prev != -1) E.rcache[e->prev].next = e->next;
+   else E.rcache_head = e->next;
+   if (e->next != -1) E.rcache[e->next].prev = e->prev;
+   else E.rcache_tail = e->prev;
+}
+
+void render_cache_push(int slot, int front)
+{
+   struct render_entry * e = &E.rcache[slot];
+   if (front) {
+      e->prev = -1;
+      e->next = E.rcache_head;
+      if (E.rcache_head != -1) E.rcache[E.rcache_head].prev = slot;
+      else E.rcache_tail = slot;
+      E.rcache_head = slot;
+   } else {
+      e->next = -1;
+      e->prev = E.rcache_tail;
+      if (E.rcache_tail != -1) E.rcache[E.rcache_tail].next = slot;
+      else E.rcache_head = slot;
+      E.rcache_tail = slot;
+   }
+}
+
+// the cache entry row owns, moved to the front, or NULL if it has none
+struct render_entry * render_cache_get(erow * row)
+{
+   if (E.rcache == NULL || row->rslot == -1 || E.rcache[row->rslot].tag != row->rtag)
+      return NULL;
+   render_cache_unlink(row->rslot);
+   render_cache_push(row->rslot, 1);
+   return &E.rcache[row->rslot];
+}
+
+// hands the least recently used entry over to row
+struct render_entry * render_cache_take(erow * row)
+{
+   if (E.rcache == NULL) {
+      E.rcache = calloc(RENDER_CACHE_ROWS, sizeof(struct render_entry));
+      if (E.rcache == NULL) die("calloc");
+      E.rcache_head = E.rcache_tail = -1;
+      for (int i = 0; i < RENDER_CACHE_ROWS; i++) render_cache_push(i, 0);
+   }
+
+   int slot = E.rcache_tail;
+   render_cache_unlink(slot);
+   render_cache_push(slot, 1);
+   row->rslot = slot;
+   row->rtag = E.rcache[slot].tag = ++E.rcache_tags;
+   return &E.rcache[slot];
+}
+
+// gives back row's entry, if it has one, to be reused first
+void render_cache_drop(erow * row)
+{
+   if (E.rcache == NULL || row->rslot == -1 || E.rcache[row->rslot].tag != row->rtag)
+      return;
+   E.rcache[row->rslot].tag = 0;
+   render_cache_unlink(row->rslot);
+   render_cache_push(row->rslot, 0);
+   row->rslot = -1;
+}
+
+// comment state at the end of row at. rows above the watermark in lazy
+// leaves are only asked about at the end of their leaf
+int editor_hl_state(int at)
+{
+   int pos;
+   struct row_node * leaf = row_tree_locate(at, &pos);
+   return leaf->lazy ? leaf->hl_open_comment : leaf->u.rows[pos].hl_open_comment;
+}
+
+// checks rows [from, to) top down, re-highlighting the ones that are
+// stale or whose starting state changed, and marks them all valid. lazy
+// leaves are highlighted whole without being loaded
+void editor_highlight_rows(int from, int to)
+{
+   int pos;
+   struct row_node * leaf = row_tree_locate(from, &pos);
+   if (leaf->lazy) {
+      from -= pos;
+      pos = 0;
+   }
+   int state = from > 0 ? editor_hl_state(from - 1) : 0;
+
+   struct row_node * few[16];
+   int cap = 16, nleaves = 0;
+   struct row_node ** leaves = few;
+   int left = to - from + pos;
+   for (;;) {
+      if (nleaves == cap) {
+         cap *= 2;
+         if (leaves == few) {
+            leaves = malloc(sizeof(struct row_node *) * cap);
+            memcpy(leaves, few, sizeof(few));
+         } else {
+            leaves = realloc(leaves, sizeof(struct row_node *) * cap);
+         }
+      }
+      leaves[nleaves++] = leaf;
+      if (left <= leaf->n) break;
+      left -= leaf->n;
+      leaf = row_leaf_next(leaf);
+   }
+   if (leaf->lazy) {
+      to += leaf->n - left;
+      left = leaf->n;
+   }
+
+   editor_highlight_leaves(leaves, nleaves, pos, left, state);
+   if (leaves != few) free(leaves);
+   if (to > E.hl_valid) E.hl_valid = to;
+}
+
+/* brings row at up to date for drawing and returns its rendered text. all
+ * rows above E.hl_valid are known to be highlighted from the right
+ * starting state, so everything from there down to this row is checked,
+ * and only rows that are stale or whose starting state changed get
+ * re-highlighted. an edit that opens a comment pays for the rows on
+ * screen; rows further down wait until they are shown, or until the
+ * editor is idle. the result is good until RENDER_CACHE_ROWS other rows
+ * have been refreshed */
+struct row_render * editor_row_refresh(int at)
+{
+   if (E.syntax && at >= E.hl_valid) editor_highlight_rows(E.hl_valid, at + 1);
+
+   erow * row = editor_row_at(at);
+   struct render_entry * e = render_cache_get(row);
+   if (e && e->gen == E.render_gen && e->hl_start == row->hl_start) return &e->r;
+
+   if (e == NULL) e = render_cache_take(row);
+   editor_render_row(row, &e->r);
+   editor_syntax_row(&e->r, row->hl_start);
+   e->gen = E.render_gen;
+   e->hl_start = row->hl_start;
+   e->match_gen = 0;
+   return &e->r;
+}
+
+// marks edited row idx for re-highlighting and drops it out of the valid rows
+void editor_row_changed_at(erow * row, int idx)
+{
+   row->stale = 1;
+   render_cache_drop(row);
+   row_node_bytes_stale(row->leaf);
+   if (idx < E.hl_valid) E.hl_valid = idx;
+   if (idx < E.save_from) E.save_from = idx;
+}
+
+void editor_row_changed(erow * row)
+{
+   editor_row_changed_at(row, editor_row_idx(row));
+}
+
+// uses idle time to carry highlighting on past the screen
+void editor_idle()
+{
+   if (E.syntax == NULL || E.hl_valid >= E.numrows) return;
+
+   int pos;
+   int to = E.hl_valid;
+   struct row_node * leaf = row_tree_locate(to, &pos);
+   to -= pos;
+   while (leaf && to < E.hl_valid + HL_IDLE_ROWS) {
+      to += leaf->n;
+      leaf = row_leaf_next(leaf);
+   }
+   if (to > E.hl_valid) editor_highlight_rows(E.hl_valid, to);
+}
+
+void journal_put_varint(struct abuf * ab, unsigned long long v)
+{
+   char b[10];
+   int n = 0;
+   do {
+      b[n++] = (v & 0x7f) | (v > 0x7f ? 0x80 : 0);
+      v >>= 7;
+   } while (v);
+   ab_append(ab, b, n);
+}
+
+// reads a varint off *p, which ends at end. returns -1 if it runs off the end
+int journal_get_varint(const char ** p, const char * end, unsigned long long * v)
+{
+   *v = 0;
+   for (int shift = 0; *p < end && shift < 64; shift += 7) {
+      unsigned char b = *(*p)++;
+      *v |= (unsigned long long)(b & 0x7f) << shift;
+      if (!(b & 0x80)) return 0;
+   }
+   return -1;
+}
+
+// writes out what's buffered. on failure journaling stops
+void editor_journal_flush()
+{
+   struct edit_journal * j = &E.journal;
+   if (j->buf.len == 0 || j->fd == -1) return;
+
+   int sent = 0;
+   while (sent < j->buf.len) {
+      int n = write(j->fd, j->buf.b + sent, j->buf.len - sent);
+      if (n == -1 && errno == EINTR) continue;
+      if (n <= 0) {
+         editor_set_status_message("Journal stopped! I/O error: %s", strerror(errno));
+         close(j->fd);
+         j->fd = -1;
+         j->on = 0;
+         break;
+      }
+      sent += n;
+   }
+   j->buf.len = 0;
+   j->last = -1;
+}
+
+// the magic, then the size and mtime of the file the edits apply to
+void journal_put_header(struct abuf * ab)
+{
+   struct edit_journal * j = &E.journal;
+   ab_append(ab, JOURNAL_MAGIC, strlen(JOURNAL_MAGIC));
+   journal_put_varint(ab, j->base_size);
+   journal_put_varint(ab, j->base_sec);
+   journal_put_varint(ab, j->base_nsec);
+}
+
+/* creates the journal file, with its header, for the first edit since a
+ * save. its name is easy to guess, so whatever's there is unlinked and
+ * the file made anew, never opened through a link someone left there */
+int editor_journal_create()
+{
+   struct edit_journal * j = &E.journal;
+   unlink(j->path);
+   j->fd = open(j->path, O_RDWR | O_CREAT | O_EXCL | O_NOFOLLOW, 0600);
+   if (j->fd == -1) {
+      j->on = 0;
+      return -1;
+   }
+
+   struct abuf head = ABUF_INIT;
+   journal_put_header(&head);
+   int ok = write(j->fd, head.b, head.len) == head.len;
+   free(head.b);
+   if (!ok) {
+      close(j->fd);
+      j->fd = -1;
+      j->on = 0;
+      return -1;
+   }
+   return 0;
+}
+
+// writes v as a varint of exactly JOURNAL_RUN_LEN bytes to b
+void journal_put_run_len(char * b, unsigned int v)
+{
+   for (int i = 0; i < JOURNAL_RUN_LEN - 1; i++) {
+      b[i] = (v & 0x7f) | 0x80;
+      v >>= 7;
+   }
+   b[JOURNAL_RUN_LEN - 1] = v & 0x7f;
+}
+
+// a 'c' record's length is fixed width, so typing can be added to the
+// end of it in place
+void journal_put_record(struct abuf * ab, char op, int row, int col, const char * s, int len)
+{
+   ab_append(ab, &op, 1);
+   journal_put_varint(ab, row);
+   journal_put_varint(ab, col);
+   if (op == 'c') {
+      char b[JOURNAL_RUN_LEN];
+      journal_put_run_len(b, len);
+      ab_append(ab, b, JOURNAL_RUN_LEN);
+   } else {
+      journal_put_varint(ab, len);
+   }
+   if (len) ab_append(ab, s, len);
+}
+
+void editor_journal(char op, int row, int col, const char * s, int len)
+{
+   struct edit_journal * j = &E.journal;
+   if (!j->on) return;
+   if (j->fd == -1 && editor_journal_create() == -1) return;
+
+   // typing into a row turns into one record for the whole run
+   if (op == 'c' && j->last != -1 && j->buf.b[j->last] == 'c' &&
+         row == j->last_row && col == j->last_col + j->last_len) {
+      journal_put_run_len(j->buf.b + j->buf.len - j->last_len - JOURNAL_RUN_LEN, j->last_len + len);
+      ab_append(&j->buf, s, len);
+      j->last_len += len;
+      return;
+   }
+
+   if (j->buf.len == 0) editor_timer_set(editor_journal_flush, JOURNAL_FLUSH_MS);
+   j->last = j->buf.len;
+   j->last_row = row;
+   j->last_col = col;
+   j->last_len = len;
+   journal_put_record(&j->buf, op, row, col, s, len);
+}
+
+void editor_insert_row(int at, char * s, size_t len)
+{
+   if (at < 0 || at > E.numrows) return;
+
+   editor_journal('I', at, 0, s, len);
+   editor_row_init(row_tree_insert(at), s, len);
+   E.numrows++;
+   if (at < E.hl_valid) E.hl_valid = at;
+   if (at < E.save_from) E.save_from = at;
+   E.dirty++;
+}
+
+void editor_free_row(erow * row)
+{
+   render_cache_drop(row);
+   free(row->chars);
+}
+
+void editor_del_row(int at)
+{
+   if (at < 0 || at >= E.numrows) return;
+   editor_journal('D', at, 0, NULL, 0);
+   editor_free_row(editor_row_at(at));
+   row_tree_remove(at);
+   E.numrows--;
+   if (at < E.hl_valid) E.hl_valid = at;
+   if (at < E.save_from) E.save_from = at;
+   E.dirty++;
+}
+
+void editor_row_insert_char(erow * row, int at, int c)
+{
+   if (at < 0 || at > row->size) at = row->size;
+   char ch = c;
+   editor_journal('c', editor_row_idx(row), at, &ch, 1);
+   editor_row_move_gap(row, at);
+   editor_row_reserve(row, 1);
+   row->chars[row->gap++] = c;
+   row->gaplen--;
+   row->size++;
+   editor_row_changed(row);
+   E.dirty++;
+}
+
+void editor_row_append_string(erow * row, char * s, size_t len)
+{
+   editor_journal('a', editor_row_idx(row), 0, s, len);
+   editor_row_move_gap(row, row->size);
+   editor_row_reserve(row, len);
+   memcpy(&row->chars[row->gap], s, len);
+   row->gap += len;
+   row->gaplen -= len;
+   row->size += len;
+   editor_row_changed(row);
+   E.dirty++;
+}
+
+void editor_row_del_char(erow * row, int at) {
+   if (at < 0 || at >= row->size) return;
+   editor_journal('x', editor_row_idx(row), at, NULL, 0);
+   editor_row_move_gap(row, at + 1);
+   row->gap--;
+   row->gaplen++;
+   row->size--;
+   editor_row_changed(row);
+   E.dirty++;
+}
+
+// drops everything from at to the end of the row
+void editor_row_truncate(erow * row, int at)
+{
+   if (at < 0 || at >= row->size) return;
+   editor_journal('t', editor_row_idx(row), at, NULL, 0);
+   editor_row_move_gap(row, at);
+   row->gaplen += row->size - at;
+   row->size = at;
+   editor_row_changed(row);
+   E.dirty++;
+}
+
+// gives row at new text all at once, leaving E.dirty to the caller
+void editor_row_set(erow * row, int at, const char * s, int len)
+{
+   editor_journal('r', at, 0, s, len);
+   char * chars = malloc(len + 1);
+   if (chars == NULL) die("malloc");
+   memcpy(chars, s, len);
+   chars[len] = '\0';
+   free(row->chars);
+   row->chars = chars;
+   row->size = len;
+   row->gap = len;
+   row->gaplen = 0;
+   editor_row_changed_at(row, at);
+}
+
+void editor_insert_char(int c)
+{
+   if (E.cy == E.numrows) {
+      editor_insert_row(E.numrows, "", 0);
+   }
+   editor_row_insert_char(editor_row_at(E.cy), E.cx, c);
+   E.cx++;
+}
+
+void editor_insert_newline()
+{
+   int padding = 0;
+   if (E.cx == 0) {
+      editor_insert_row(E.cy, "", 0);
+   } else {
+      erow * row = editor_row_at(E.cy);
+      char * chars = editor_row_chars(row);
+      
+      int numspaces = 0, numtabs = 0;
+      for (int i = 0; chars[i] == ' ' || chars[i] == '\t'; i++) {
+         if (chars[i] == ' ') numspaces++;
+         else numtabs++;
+      }
+      padding = (numtabs + (numspaces / E.tab_stop));
+      if (E.tabs_as_spaces == 1) padding *= E.tab_stop;
+
+      int len = padding + row->size - E.cx;
+      char * newline = malloc(len + 1);
+      memset(newline, E.tabs_as_spaces == 1 ? ' ' : '\t', padding);
+      memcpy(&newline[padding], &chars[E.cx], row->size - E.cx);
+      newline[len] = '\0';
+      editor_insert_row(E.cy + 1, newline, len);
+      free(newline);
+      editor_row_truncate(editor_row_at(E.cy), E.cx);
+   }
+   E.cy++;
+   E.cx = padding;
+}
+
+/* inserts a block of text at the cursor in one go, for pastes: the row
+ * is split once, lines in between become rows as they are, and no
+ * auto-indent is added. \r, \n and \r\n all end a line */
+void editor_insert_text(const char * s, int len)
+{
+   if (E.cy == E.numrows) editor_insert_row(E.numrows, "", 0);
+
+   // the rest of the row after the cursor goes after the last line
+   erow * row = editor_row_at(E.cy);
+   int taillen = row->size - E.cx;
+   char * tail = NULL;
+   if (taillen > 0) {
+      tail = malloc(taillen);
+      memcpy(tail, &editor_row_chars(row)[E.cx], taillen);
+      editor_row_truncate(row, E.cx);
+   }
+
+   const char * p = s;
+   const char * end = s + len;
+   for (;;) {
+      const char * eol = p;
+      while (eol < end && *eol != '\r' && *eol != '\n') eol++;
+      if (eol > p) {
+         if (p == s) {
+            editor_row_append_string(row, (char *)p, eol - p);
+         } else {
+            editor_insert_row(E.cy, (char *)p, eol - p);
+         }
+      } else if (p != s) {
+         editor_insert_row(E.cy, "", 0);
+      }
+      E.cx = (p == s ? E.cx : 0) + (eol - p);
+      if (eol == end) break;
+
+      p = eol + (eol[0] == '\r' && eol + 1 < end && eol[1] == '\n' ? 2 : 1);
+      E.cy++;
+   }
+
+   if (tail) {
+      editor_row_append_string(editor_row_at(E.cy), tail, taillen);
+      free(tail);
+   }
+}
+
+void editor_del_char()
+{
+   if (E.cy == E.numrows) return;
+   if (E.cx == 0 && E.cy == 0) return;
+
+   erow * row = editor_row_at(E.cy);
+   if (E.cx > 0) {
+      editor_row_del_char(row, E.cx - 1);
+      E.cx--;
+   } else {
+      erow * prev = editor_row_at(E.cy - 1);
+      E.cx = prev->size;
+      editor_row_append_string(prev, editor_row_chars(row), row->size);
+      editor_del_row(E.cy);
+      E.cy--;
+   }
+}
+
+/* streams the rows out to fd with writev, straight from the map and the
+ * row buffers. pieces that follow each other in memory are merged, so a
+ * stretch of unloaded rows goes out as a single piece */
+struct save_writer {
+   int fd;
+   struct iovec iov[SAVE_IOV];
+   int n;
+   long long total;
+   int err;
+};
+
+void save_flush(struct save_writer * w)
+{
+   struct iovec * iov = w->iov;
+   int n = w->n;
+   w->n = 0;
+   while (n > 0 && !w->err) {
+      ssize_t done = writev(w->fd, iov, n);
+      if (done == -1) {
+         if (errno != EINTR) w->err = errno;
+         continue;
+      }
+      while (n > 0 && (size_t)done >= iov->iov_len) {
+         done -= iov->iov_len;
+         iov++;
+         n--;
+      }
+      if (n > 0) {
+         iov->iov_base = (char *)iov->iov_base + done;
+         iov->iov_len -= done;
+      }
+   }
+}
+
+void save_put(struct save_writer * w, const char * s, size_t len)
+{
+   if (len == 0) return;
+   w->total += len;
+   if (w->n > 0) {
+      struct iovec * last = &w->iov[w->n - 1];
+      if ((char *)last->iov_base + last->iov_len == s) {
+         last->iov_len += len;
+         return;
+      }
+   }
+   if (w->n == SAVE_IOV) save_flush(w);
+   w->iov[w->n].iov_base = (void *)s;
+   w->iov[w->n].iov_len = len;
+   w->n++;
+}
+
+// writes the rows from row from on to fd. returns 0, or the errno
+// writing failed with
+int editor_write_rows(int fd, int from, long long * total)
+{
+   struct save_writer w;
+   w.fd = fd;
+   w.n = 0;
+   w.total = 0;
+   w.err = 0;
+
+   int pos = 0;
+   struct row_node * leaf = from < E.numrows ? row_tree_locate(from, &pos) : NULL;
+   for (; leaf && !w.err; leaf = row_leaf_next(leaf), pos = 0) {
+      for (int i = pos; i < leaf->n; i++) {
+         if (leaf->lazy) {
+            int len;
+            char * line = editor_map_line(leaf->u.offs[i], leaf->u.offs[i + 1], &len);
+            // the line's own newline goes along when it's a plain \n
+            if (line + len < E.map + E.map_len && line[len] == '\n') {
+               save_put(&w, line, len + 1);
+               continue;
+            }
+            save_put(&w, line, len);
+         } else {
+            erow * row = &leaf->u.rows[i];
+            save_put(&w, row->chars, row->gap);
+            save_put(&w, &row->chars[row->gap + row->gaplen], row->size - row->gap);
+         }
+         save_put(&w, "\n", 1);
+      }
+   }
+   save_flush(&w);
+   *total = w.total;
+   return w.err;
+}
+
+// the file a save replaces, with symlinks followed
+char * editor_save_target()
+{
+   char * target = realpath(E.filename, NULL);
+   return target ? target : strdup(E.filename);
+}
+
+/* a temp file next to target, with target's permissions and owner.
+ * returns its fd, with its name in tmp, or -1 when there's no making one
+ * or it can't be given target's owner */
+int editor_save_open_tmp(const char * target, char ** tmp)
+{
+   const char * base = strrchr(target, '/');
+   int dirlen = base ? base - target + 1 : 0;
+   base = base ? base + 1 : target;
+
+   *tmp = malloc(strlen(target) + 16);
+   sprintf(*tmp, "%.*s.%s.XXXXXX", dirlen, target, base);
+   int fd = mkstemp(*tmp);
+   if (fd == -1) {
+      free(*tmp);
+      *tmp = NULL;
+      return -1;
+   }
+
+   struct stat st;
+   int ok;
+   if (stat(target, &st) == 0) {
+      // fails unless we're root or own the file and are in its group
+      ok = fchown(fd, st.st_uid, st.st_gid) == 0 && fchmod(fd, st.st_mode & 07777) == 0;
+   } else {
+      mode_t mask = umask(0);
+      umask(mask);
+      ok = fchmod(fd, 0666 & ~mask) == 0;
+   }
+   if (!ok) {
+      int err = errno;
+      close(fd);
+      unlink(*tmp);
+      free(*tmp);
+      *tmp = NULL;
+      errno = err;
+      return -1;
+   }
+   return fd;
+}
+
+/* opens target to be written over from off on, where row from starts.
+ * when the map is of this very file, rows from there on that still read
+ * from it are copied out before it changes underneath them */
+int editor_save_open_rewrite(const char * target, int from, long long off)
+{
+   struct stat st;
+   int fd = open(target, O_WRONLY);
+   if (fd == -1) return -1;
+   if (fstat(fd, &st) == -1 || lseek(fd, off, SEEK_SET) == -1) {
+      int err = errno;
+      close(fd);
+      errno = err;
+      return -1;
+   }
+
+   if (E.map && st.st_dev == E.map_dev && st.st_ino == E.map_ino && from < E.numrows) {
+      int pos;
+      struct row_node * leaf = row_tree_locate(from, &pos);
+      for (; leaf; leaf = row_leaf_next(leaf)) leaf = row_leaf_load(leaf);
+   }
+   return fd;
+}
+
+/* opens target to be rewritten in place from the first changed row on.
+ * that's only done while the file is still the one last saved (or
+ * opened), and when at least half of it stays as it is; otherwise -1.
+ * off is where the rewrite starts */
+int editor_save_open_in_place(const char * target, long long * off)
+{
+   struct stat st;
+   if (!E.disk_known || E.save_from == 0) return -1;
+   if (stat(target, &st) == -1 || st.st_dev != E.disk.st_dev ||
+         st.st_ino != E.disk.st_ino || st.st_size != E.disk.st_size ||
+         st.st_mtim.tv_sec != E.disk.st_mtim.tv_sec ||
+         st.st_mtim.tv_nsec != E.disk.st_mtim.tv_nsec)
+      return -1;
+
+   *off = row_tree_offset(E.save_from);
+   if (*off < row_node_bytes(E.rows) / 2) return -1;
+   return editor_save_open_rewrite(target, E.save_from, *off);
+}
+
+// makes the rename in the directory holding target durable
+void editor_sync_dir(const char * target)
+{
+   const char * slash = strrchr(target, '/');
+   char * dir = slash ? strndup(target, slash - target + 1) : strdup(".");
+   int fd = open(dir, O_RDONLY);
+   if (fd != -1) {
+      fsync(fd);
+      close(fd);
+   }
+   free(dir);
+}
+
+void * editor_save_sync(void * arg)
+{
+   struct save_job * job = arg;
+   int err = 0;
+   if (fsync(job->fd) == -1) err = errno;
+   if (close(job->fd) == -1 && !err) err = errno;
+   if (job->journal_fd != -1) {
+      fsync(job->journal_fd);
+      close(job->journal_fd);
+   }
+   if (job->tmp) {
+      if (!err && rename(job->tmp, job->target) == -1) err = errno;
+      if (err) unlink(job->tmp);
+      else editor_sync_dir(job->target);
+   }
+
+   job->err = err;
+   __atomic_store_n(&job->done, 1, __ATOMIC_RELEASE);
+   return NULL;
+}
+
+/* finishes off a save syncing in the background, waiting for it if wait
+ * is set. otherwise it's looked at again in a bit while it's still going.
+ * a failed sync puts the buffer back to modified */
+void editor_save_finish(int wait)
+{
+   if (!E.save.active) return;
+   if (!wait && !__atomic_load_n(&E.save.done, __ATOMIC_ACQUIRE)) {
+      editor_timer_set(editor_save_check, SAVE_POLL_MS);
+      return;
+   }
+
+   pthread_join(E.save.thread, NULL);
+   E.save.active = 0;
+   if (!E.save.err) editor_journal_rebase(E.save.target, E.save.journaled);
+   free(E.save.tmp);
+   free(E.save.target);
+   if (E.save.err) {
+      E.dirty++;
+      E.disk_known = 0;
+      editor_set_status_message("Can't save! I/O error: %s", strerror(E.save.err));
+      if (!wait) editor_refresh_screen();
+   }
+}
+
+void editor_save_check()
+{
+   editor_save_finish(0);
+}
+
+// forgets the journal, and the edits in it, once they're saved or thrown away
+void editor_journal_discard()
+{
+   struct edit_journal * j = &E.journal;
+   if (j->fd != -1) {
+      close(j->fd);
+      j->fd = -1;
+      unlink(j->path);
+   }
+   j->buf.len = 0;
+   j->last = -1;
+}
+
+// starts journaling edits to the file at target, as it is in base
+void editor_journal_start(const char * target, const struct stat * base)
+{
+   struct edit_journal * j = &E.journal;
+   const char * name = strrchr(target, '/');
+   int dirlen = name ? name - target + 1 : 0;
+   name = name ? name + 1 : target;
+
+   free(j->path);
+   j->path = malloc(strlen(target) + 16);
+   sprintf(j->path, "%.*s.%s.yar-journal", dirlen, target, name);
+   j->base_size = base->st_size;
+   j->base_sec = base->st_mtim.tv_sec;
+   j->base_nsec = base->st_mtim.tv_nsec;
+   j->on = 1;
+}
+
+/* where the journal ends, for a save about to start. 0 when there's no
+ * journal file yet, which is never the end of a record (the header comes
+ * first) */
+long long editor_journal_mark()
+{
+   struct edit_journal * j = &E.journal;
+   editor_journal_flush();
+   if (j->fd == -1) return 0;
+   off_t end = lseek(j->fd, 0, SEEK_CUR);
+   return end == -1 ? 0 : end;
+}
+
+/* a save that started when the journal ended at journaled is on disk.
+ * the edits up to there are in the file now, so the journal starts over
+ * against it, keeping only the records made while the save was going */
+void editor_journal_rebase(const char * target, long long journaled)
+{
+   struct edit_journal * j = &E.journal;
+   editor_journal_flush();
+
+   char * tail = NULL;
+   long long len = 0;
+   if (j->fd != -1) {
+      if (journaled == 0) {
+         struct abuf head = ABUF_INIT;
+         journal_put_header(&head);
+         journaled = head.len;
+         free(head.b);
+      }
+      off_t end = lseek(j->fd, 0, SEEK_CUR);
+      if (end > journaled && (tail = malloc(end - journaled)) &&
+            pread(j->fd, tail, end - journaled, journaled) == end - journaled)
+         len = end - journaled;
+   }
+
+   editor_journal_discard();
+   editor_journal_start(target, &E.disk);
+   if (len && editor_journal_create() == 0) {
+      ab_append(&j->buf, tail, len);
+      editor_journal_flush();
+   }
+   free(tail);
+}
+
+/* before a save rewrites the file in place from row from (at byte off)
+ * on, the rows it's about to write go in the journal as a 'W' record,
+ * the offset first, and are synced. a crash halfway through leaves the
+ * file torn, but its start still holds the rows before from and the
+ * record has the rest. returns -1 if the record couldn't be written */
+int editor_journal_save(int from, long long off)
+{
+   struct edit_journal * j = &E.journal;
+   if (!j->on) return -1;
+   if (j->fd == -1 && editor_journal_create() == -1) return -1;
+   editor_journal_flush();
+   if (j->fd == -1) return -1;
+
+   off_t at = lseek(j->fd, 0, SEEK_CUR);
+   if (at == -1) return -1;
+
+   struct abuf head = ABUF_INIT;
+   struct abuf offset = ABUF_INIT;
+   long long size = row_tree_offset(E.numrows) - off;
+   journal_put_varint(&offset, off);
+   ab_append(&head, "W", 1);
+   journal_put_varint(&head, from);
+   journal_put_varint(&head, 0);
+   journal_put_varint(&head, offset.len + size);
+   ab_append(&head, offset.b, offset.len);
+
+   long long len;
+   int ok = write(j->fd, head.b, head.len) == head.len &&
+      editor_write_rows(j->fd, from, &len) == 0 && len == size && fsync(j->fd) == 0;
+   free(head.b);
+   free(offset.b);
+   if (!ok) {
+      // the journal carries on from before the record
+      if (ftruncate(j->fd, at) == -1 || lseek(j->fd, at, SEEK_SET) == -1) {
+         close(j->fd);
+         j->fd = -1;
+         j->on = 0;
+      }
+      return -1;
+   }
+   return 0;
+}
+
+/* a save is about to put a file with stat st in place. an 'N' record
+ * with its size and mtime tells recovery that the records after it go
+ * with that file, should the editor go away before it starts the
+ * journal over */
+void editor_journal_saved(const struct stat * st)
+{
+   struct edit_journal * j = &E.journal;
+   if (j->fd == -1) return;
+
+   struct abuf ab = ABUF_INIT;
+   journal_put_varint(&ab, st->st_size);
+   journal_put_varint(&ab, st->st_mtim.tv_sec);
+   journal_put_varint(&ab, st->st_mtim.tv_nsec);
+   editor_journal('N', 0, 0, ab.b, ab.len);
+   free(ab.b);
+}
+
+/* the rows a 'W' record at rec says a save wrote, from its row on. its
+ * offset has to be where that row starts now, since the rows before it
+ * are taken from the file. returns where the rows start, or NULL */
+const char * journal_save_rows(const char * rec, const char * end, int * row, const char ** rows_end)
+{
+   const char * p = rec + 1;
+   unsigned long long r, col, len, off;
+   if (journal_get_varint(&p, end, &r) == -1 ||
+         journal_get_varint(&p, end, &col) == -1 ||
+         journal_get_varint(&p, end, &len) == -1 ||
+         len > (unsigned long long)(end - p) || r > (unsigned long long)E.numrows)
+      return NULL;
+   *rows_end = p + len;
+   if (journal_get_varint(&p, *rows_end, &off) == -1 ||
+         (long long)off != row_tree_offset(r))
+      return NULL;
+   *row = r;
+   return p;
+}
+
+/* where the records that go with the file as it is now start, going by
+ * the last save in [p, end) that left it that way: from a 'W' record
+ * that fits the rows, or after an 'N' naming the file's size and mtime.
+ * NULL if there's none */
+const char * journal_last_save(const char * p, const char * end)
+{
+   struct edit_journal * j = &E.journal;
+   const char * last = NULL;
+   while (p < end) {
+      const char * rec = p++;
+      unsigned long long row, col, len;
+      if (journal_get_varint(&p, end, &row) == -1 ||
+            journal_get_varint(&p, end, &col) == -1 ||
+            journal_get_varint(&p, end, &len) == -1 ||
+            len > (unsigned long long)(end - p))
+         break;
+      const char * s = p;
+      p += len;
+
+      int from;
+      const char * rows_end;
+      unsigned long long size, sec, nsec;
+      if (*rec == 'W' && journal_save_rows(rec, end, &from, &rows_end)) {
+         last = rec;
+      } else if (*rec == 'N' && journal_get_varint(&s, p, &size) == 0 &&
+            journal_get_varint(&s, p, &sec) == 0 && journal_get_varint(&s, p, &nsec) == 0 &&
+            (long long)size == j->base_size && (long long)sec == j->base_sec &&
+            (long long)nsec == j->base_nsec) {
+         last = p;
+      }
+   }
+   return last;
+}
+
+/* applies the records in [p, end) to the rows, counting them in count.
+ * returns where the last whole record that made sense ends */
+const char * editor_journal_replay(const char * p, const char * end, int * count)
+{
+   while (p < end) {
+      const char * rec = p;
+      char op = *p++;
+      unsigned long long row, col, len;
+      if (journal_get_varint(&p, end, &row) == -1 ||
+            journal_get_varint(&p, end, &col) == -1 ||
+            journal_get_varint(&p, end, &len) == -1 ||
+            len > (unsigned long long)(end - p) || row > INT_MAX || col > INT_MAX)
+         return rec;
+      const char * s = p;
+      p += len;
+
+      if (op == 'N') {
+         // a save's file: the rows already are what it holds
+         continue;
+      } else if (op == 'W') {
+         // the rows the save wrote stand in for whatever's there now
+         int from;
+         const char * rows_end;
+         const char * q = journal_save_rows(rec, end, &from, &rows_end);
+         if (q == NULL) return rec;
+         while (E.numrows > from) editor_del_row(E.numrows - 1);
+         while (q < rows_end) {
+            const char * nl = memchr(q, '\n', rows_end - q);
+            int n = nl ? nl - q : rows_end - q;
+            editor_insert_row(E.numrows, (char *)q, n);
+            q += n + 1;
+         }
+      } else if (op == 'I') {
+         if (row > (unsigned long long)E.numrows) return rec;
+         editor_insert_row(row, (char *)s, len);
+      } else if (op == 'D') {
+         if (row >= (unsigned long long)E.numrows) return rec;
+         editor_del_row(row);
+      } else {
+         if (row >= (unsigned long long)E.numrows) return rec;
+         erow * r = editor_row_at(row);
+         switch (op) {
+            case 'c':
+               for (unsigned long long i = 0; i < len; i++) editor_row_insert_char(r, col + i, s[i]);
+               break;
+            case 'x': editor_row_del_char(r, col); break;
+            case 'a': editor_row_append_string(r, (char *)s, len); break;
+            case 't': editor_row_truncate(r, col); break;
+            case 'r':
+               editor_row_set(r, row, s, len);
+               E.dirty++;
+               break;
+            default: return rec;
+         }
+      }
+      (*count)++;
+   }
+   return p;
+}
+
+/* moves the journal out of the way under a name of its own, leaving
+ * journaling to start over. returns -1, journaling off, if it can't */
+int editor_journal_set_aside(char * aside, int size)
+{
+   struct edit_journal * j = &E.journal;
+   for (int n = 0; n < 100; n++) {
+      if (n) snprintf(aside, size, "%s.orphan%d", j->path, n);
+      else snprintf(aside, size, "%s.orphan", j->path);
+      if (link(j->path, aside) == 0) {
+         unlink(j->path);
+         return 0;
+      }
+      if (errno != EEXIST) break;
+   }
+   j->on = 0;
+   return -1;
+}
+
+/* looks for a journal left behind by an editor that didn't get to save,
+ * and replays it over the file just opened. when a save got as far as
+ * changing the file, its 'W' or 'N' record says where the records for
+ * the file as it is now start. a journal that doesn't go with the file
+ * (it was changed some other way) is never thrown away unasked: it can
+ * be replayed anyway, kept aside under another name, or deleted. only a
+ * plain file of our own is trusted. either way, edits from here on are
+ * journaled */
+void editor_journal_recover()
+{
+   char * target = editor_save_target();
+   struct stat st;
+   if (stat(target, &st) == -1) {
+      free(target);
+      return;
+   }
+   editor_journal_start(target, &st);
+   free(target);
+
+   struct edit_journal * j = &E.journal;
+   int fd = open(j->path, O_RDWR | O_NOFOLLOW);
+   if (fd == -1 && errno == ENOENT) return;
+
+   struct stat jst;
+   if (fd == -1 || fstat(fd, &jst) == -1 || !S_ISREG(jst.st_mode) || jst.st_uid != getuid()) {
+      if (fd != -1) close(fd);
+      j->on = 0;
+      editor_set_status_message("Not journaling: %s isn't a file of yours", j->path);
+      return;
+   }
+
+   // one cut off before its header has nothing in it
+   if (jst.st_size == 0) {
+      close(fd);
+      unlink(j->path);
+      return;
+   }
+
+   char * data = malloc(jst.st_size);
+   off_t size = 0;
+   while (data && size < jst.st_size) {
+      ssize_t n = read(fd, data + size, jst.st_size - size);
+      if (n == -1 && errno == EINTR) continue;
+      if (n <= 0) break;
+      size += n;
+   }
+   if (size < jst.st_size) {
+      free(data);
+      close(fd);
+      j->on = 0;
+      editor_set_status_message("Not journaling: can't read %s", j->path);
+      return;
+   }
+
+   const char * p = data;
+   const char * end = data + size;
+   unsigned long long bsize, bsec, bnsec;
+   int magiclen = strlen(JOURNAL_MAGIC);
+   int valid = size >= magiclen && memcmp(data, JOURNAL_MAGIC, magiclen) == 0 &&
+      (p += magiclen, journal_get_varint(&p, end, &bsize)) == 0 &&
+      journal_get_varint(&p, end, &bsec) == 0 &&
+      journal_get_varint(&p, end, &bnsec) == 0;
+   int fits = valid && (long long)bsize == j->base_size &&
+      (long long)bsec == j->base_sec && (long long)bnsec == j->base_nsec;
+
+   // the records before the last save's are in the file (and a 'W')
+   const char * saved = valid ? journal_last_save(p, end) : NULL;
+   if (saved) {
+      p = saved;
+      fits = 1;
+   }
+
+   int replay = fits;
+   if (valid && !fits) {
+      editor_set_status_message("%s changed since its journal was written. "
+            "(r)eplay it anyway, (k)eep it aside, (d)elete it?", E.filename);
+      editor_refresh_screen();
+      int c = editor_read_key();
+      if (c == 'd') {
+         close(fd);
+         free(data);
+         unlink(j->path);
+         editor_set_status_message("Deleted %s", j->path);
+         return;
+      }
+      replay = c == 'r';
+   }
+
+   int count = 0;
+   off_t good = p - data;
+   if (replay) {
+      j->on = 0;
+      good = editor_journal_replay(p, end, &count) - data;
+      j->on = 1;
+   }
+   free(data);
+
+   if (!fits) {
+      /* what's in it went with some other version of the file, so it's
+       * kept aside whole. replayed, the rows now are nothing that can
+       * be told from the file, so the new journal starts with all of
+       * them */
+      close(fd);
+      char aside[PATH_MAX + 32];
+      int kept = editor_journal_set_aside(aside, sizeof(aside)) == 0;
+      if (replay && kept) editor_journal_save(0, 0);
+      if (!kept) editor_set_status_message("Not journaling: can't move %s aside", j->path);
+      else if (replay) editor_set_status_message("Replayed %d edits, kept the journal as %s", count, aside);
+      else editor_set_status_message("Kept the journal as %s", aside);
+      E.cx = 0;
+      E.cy = 0;
+      return;
+   }
+
+   // a record cut off by a crash is dropped, new ones go after the rest
+   if (ftruncate(fd, good) == -1 || lseek(fd, 0, SEEK_END) == -1) {
+      close(fd);
+      fd = -1;
+      j->on = 0;
+   }
+   j->fd = fd;
+   E.cx = 0;
+   E.cy = 0;
+   editor_set_status_message("Recovered %d edits from %s", count, j->path);
+}
+
+void editor_on_hangup(int sig)
+{
+   (void)sig;
+   E.hangup = 1;
+}
+
+/* a read of the map past the end of a file cut short since it was opened
+ * (logrotate's copytruncate, say) faults. whichever thread it was in, the
+ * rest of the map is swapped for zero pages and the read goes on */
+void editor_on_bus(int sig, siginfo_t * info, void * ctx)
+{
+   (void)ctx;
+   char * addr = info->si_addr;
+   if (E.map == NULL || addr < E.map || addr >= E.map + E.map_len) {
+      signal(sig, SIG_DFL);
+      return;
+   }
+
+   char * from = E.map + ((addr - E.map) & ~(E.page_size - 1));
+   if (mmap(from, E.map + E.map_len - from, PROT_READ,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) == MAP_FAILED) {
+      signal(sig, SIG_DFL);
+      return;
+   }
+   E.map_lost = 1;
+}
+
+// tells about a shrunk file once, which from then on isn't what it was
+void editor_check_map()
+{
+   if (E.map_lost != 1) return;
+   E.map_lost = 2;
+   E.disk_known = 0;
+   E.dirty++;
+   editor_set_status_message("%s was cut short on disk! Lines past its old end are lost",
+         E.filename);
+}
+
+void editor_force_quit() {
+   editor_save_finish(1);
+   editor_journal_discard();
+   editor_drain_output();
+   write(STDOUT_FILENO, "\x1b[2J", 4);
+   write(STDOUT_FILENO, "\x1b[H", 3);
+   exit(0);
+}
+
+void editor_quit(int * quit_times) {
+   if (E.dirty) {
+      // if our file is dirty we have 2 options
+      // one, we tried to quit with CTRL+Q. then quit_times will be valid. warn to press again
+      // otherwise, we did :q and we should advise to save or q!
+      if (quit_times != NULL) {
+         if (*quit_times > 0) {
+            editor_set_status_message("WARNING: Unsaved changes. Press again to force quit.");
+            *quit_times = *quit_times - 1;
+            return;
+         }
+      } else {
+         editor_set_status_message("WARNING: Unsaved changes. Use ':wq' to save & quit or ':q!' to force quit.");
+         return;
+      }
+   }
+   editor_force_quit();
+}
+
+void editor_open(char * filename)
+{
+   free(E.filename);
+   E.filename = strdup(filename);
+
+   editor_select_syntax_highlight();
+
+   int fd = open(filename, O_RDONLY);
+   if (fd == -1) die("open");
+
+   // regular files are mapped and only their line offsets are indexed up
+   // front. rows are built from the map as they're needed
+   struct stat st;
+   if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+      char * map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (map != MAP_FAILED) {
+         close(fd);
+         E.map = map;
+         E.map_len = st.st_size;
+         E.map_dev = st.st_dev;
+         E.map_ino = st.st_ino;
+         int cr = row_tree_build_lazy();
+
+         // saving writes lines back with plain newlines, so the file
+         // already matches the rows up to the first that it would change
+         E.disk_known = 1;
+         E.disk = st;
+         E.save_from = E.numrows;
+         if (map[st.st_size - 1] != '\n') E.save_from = E.numrows - 1;
+         if (cr) E.save_from = 0;
+         E.dirty = 0;
+         editor_journal_recover();
+         return;
+      }
+   }
+
+   FILE *fp = fdopen(fd, "r");
+   if (!fp) die ("fdopen");
+
+   char *line = NULL;
+   size_t linecap = 0;
+   ssize_t linelen;
+   while ((linelen = getline(&line, &linecap, fp)) != -1) {
+      while (linelen > 0 && (line[linelen - 1] == '\n' ||
+                            line[linelen - 1] == '\r'))
+         linelen--;
+      editor_insert_row(E.numrows, line, linelen);
+   }
+   free(line);
+   fclose(fp);
+   E.dirty = 0;
+   editor_journal_recover();
+}
+
+char * editor_prompt(char * prompt, void (*callback)(char *, int))
+{
+   size_t bufsize = 128;
+   char * buf = malloc(bufsize);
+
+   size_t buflen = 0;
+   buf[0] = '\0';
+
+   for(;;) {
+      editor_set_status_message(prompt, buf);
+      if (!editor_key_pending()) editor_refresh_screen();
+
+      int c = editor_read_key();
+      if (c == DEL_KEY || c == CTRL_KEY('h') || c == BACKSPACE) {
+         if (buflen != 0) buf[--buflen] = '\0';
+      } else if (c == '\x1b') {
+         editor_set_status_message("");
+         free(buf);
+         return NULL;
+      } else if (c == '\r') {
+         if (buflen != 0) {
+            editor_set_status_message("");
+            if (callback) callback(buf, c);
+            return buf;
+         }
+      } else if (c == PASTE_START) {
+         // pasted text goes in up to its first control character
+         int len;
+         char * text = editor_read_paste(&len);
+         int n = 0;
+         while (n < len && !iscntrl((unsigned char)text[n]) && (unsigned char)text[n] < 128) n++;
+         if (buflen + n >= bufsize) {
+            while (buflen + n >= bufsize) bufsize *= 2;
+            buf = realloc(buf, bufsize);
+         }
+         memcpy(&buf[buflen], text, n);
+         buflen += n;
+         buf[buflen] = '\0';
+         free(text);
+      } else if (c == PASTE_STRAY_END) {
+         continue;
+      } else if (!iscntrl(c) && c < 128) {
+         if (buflen == bufsize - 1) {
+            bufsize *= 2;
+            buf = realloc(buf, bufsize);
+         }
+         buf[buflen++] = c;
+         buf[buflen] = '\0';
+      }
+
+      if (callback) callback(buf, c);
+   }
+}
+
+void editor_save()
+{
+   if (E.filename == NULL) {
+      E.filename = editor_prompt("Save as: %s (ESC to cancel)", NULL);
+      if (E.filename == NULL) {
+         editor_set_status_message("Save aborted");
+         return;
+      }
+      editor_select_syntax_highlight();
+   }
+
+   /* when only the end of the file changed it's rewritten in place from
+    * the first changed row on, and cut short if it got shorter. otherwise
+    * the rows are streamed into a temp file next to the target, which is
+    * then renamed over it, so the old contents stay whole until the new
+    * ones are all there. that way the mapped file is only ever written to
+    * past the rows still read from it. a file with other links to it, or
+    * that a temp file can't stand in for (the directory isn't writable,
+    * or it has an owner we can't give the temp file), is rewritten in
+    * place from the top instead, like it always used to be */
+   editor_save_finish(1);
+
+   char * target = editor_save_target();
+   char * tmp = NULL;
+   long long off = 0;
+   int from = 0;
+   struct stat st;
+   int linked = stat(target, &st) == 0 && st.st_nlink > 1;
+   int fd = editor_save_open_in_place(target, &off);
+   if (fd != -1) from = E.save_from;
+   // the end is only rewritten in place while the journal can hold it
+   if (fd != -1 && editor_journal_save(from, off) == -1) {
+      close(fd);
+      fd = -1;
+      from = 0;
+   }
+   if (fd == -1 && !linked) fd = editor_save_open_tmp(target, &tmp);
+   if (fd == -1) {
+      int err = errno;
+      off = 0;
+      fd = editor_save_open_rewrite(target, 0, 0);
+      if (fd == -1 && errno == ENOENT) errno = err;
+      if (fd != -1) editor_journal_save(0, 0);
+   }
+   if (fd == -1) {
+      editor_set_status_message("Can't save! I/O error: %s", strerror(errno));
+      free(target);
+      return;
+   }
+
+   long long len;
+   int err = editor_write_rows(fd, from, &len);
+   if (!err && !tmp && ftruncate(fd, off + len) == -1) err = errno;
+   if (!err && fstat(fd, &E.disk) == -1) err = errno;
+   // the journal is only started over once the new file is in place
+   if (!err) editor_journal_saved(&E.disk);
+   long long journaled = editor_journal_mark();
+   if (!err && !E.save_fsync) {
+      if (close(fd) == -1) err = errno;
+      if (!err && tmp && rename(tmp, target) == -1) err = errno;
+      fd = -1;
+   }
+   if (err) {
+      if (fd != -1) close(fd);
+      if (tmp) unlink(tmp);
+      free(tmp);
+      free(target);
+      E.disk_known = 0;
+      editor_set_status_message("Can't save! I/O error: %s", strerror(err));
+      return;
+   }
+
+   E.dirty = 0;
+   E.disk_known = 1;
+   E.save_from = E.numrows;
+   editor_set_status_message("%lld bytes written to disk", len);
+   if (!E.save_fsync) {
+      editor_journal_rebase(target, journaled);
+      free(tmp);
+      free(target);
+      return;
+   }
+
+   // fsync can take a while, so it's left to a thread and a rename
+   // waits for it
+   E.save.fd = fd;
+   E.save.journal_fd = tmp && E.journal.fd != -1 ? dup(E.journal.fd) : -1;
+   E.save.tmp = tmp;
+   E.save.target = target;
+   E.save.journaled = journaled;
+   E.save.err = 0;
+   E.save.done = 0;
+   E.save.active = 1;
+   if (pthread_create(&E.save.thread, NULL, editor_save_sync, &E.save) != 0) {
+      editor_save_sync(&E.save);
+      E.save.active = 0;
+      if (!E.save.err) editor_journal_rebase(target, journaled);
+      free(tmp);
+      free(target);
+      if (E.save.err) {
+         E.dirty++;
+         E.disk_known = 0;
+         editor_set_status_message("Can't save! I/O error: %s", strerror(E.save.err));
+      }
+      return;
+   }
+   editor_timer_set(editor_save_check, SAVE_POLL_MS);
+}
+
+/* finds q (m bytes) in s (n bytes), returning where or -1. with SSE2,
+ * the places where both q's first and last byte line up are found 16 at a
+ * time and only those are compared in full. otherwise it's libc's memmem,
+ * which is linear */
+static inline int search_find(const char * s, int n, const char * q, int m)
+{
+   if (m == 0) return 0;
+   if (m > n) return -1;
+   if (m == 1) {
+      const char * p = memchr(s, q[0], n);
+      return p ? p - s : -1;
+   }
+
+   int i = 0;
+   int last = n - m;
+#ifdef __SSE2__
+   const __m128i first = _mm_set1_epi8(q[0]);
+   const __m128i final = _mm_set1_epi8(q[m - 1]);
+   for (; i + 15 <= last; i += 16) {
+      __m128i a = _mm_loadu_si128((const __m128i *)&s[i]);
+      __m128i b = _mm_loadu_si128((const __m128i *)&s[i + m - 1]);
+      unsigned int mask = _mm_movemask_epi8(_mm_and_si128(
+            _mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, final)));
+      while (mask) {
+         int k = __builtin_ctz(mask);
+         if (memcmp(&s[i + k + 1], q + 1, m - 2) == 0) return i + k;
+         mask &= mask - 1;
+      }
+   }
+   for (; i <= last; i++) {
+      if (s[i] == q[0] && s[i + m - 1] == q[m - 1] && memcmp(&s[i + 1], q + 1, m - 2) == 0)
+         return i;
+   }
+   return -1;
+#else
+   const char * p = memmem(s, n, q, m);
+   return p ? p - s : -1;
+#endif
+}
+
+void search_push(struct search_chunk * chunk, int row, int col, int len)
+{
+   if (chunk->nfound == chunk->cap) {
+      chunk->cap = chunk->cap ? chunk->cap * 2 : 64;
+      chunk->found = realloc(chunk->found, sizeof(struct search_match) * chunk->cap);
+      if (chunk->found == NULL) die("realloc");
+   }
+   chunk->found[chunk->nfound].row = row;
+   chunk->found[chunk->nfound].col = col;
+   chunk->found[chunk->nfound].len = len;
+   chunk->nfound++;
+}
+
+/* the parsed pattern, before it's compiled. a is the class of RN_CLASS,
+ * or the operand(s) of the rest, with b */
+enum regex_node_type {
+   RN_CLASS,
+   RN_CAT,
+   RN_ALT,
+   RN_STAR,
+   RN_PLUS,
+   RN_QUEST,
+   RN_BOL,
+   RN_EOL,
+   RN_EMPTY
+};
+
+struct regex_node {
+   int type;
+   int a, b;
+};
+
+struct regex_parser {
+   const char * p;
+   struct regex * re;
+   struct regex_node * nodes;
+   int n, cap;
+   int depth;
+   const char * err;
+};
+
+int regex_node_new(struct regex_parser * ps, int type, int a, int b)
+{
+   if (ps->n == ps->cap) {
+      ps->cap = ps->cap ? ps->cap * 2 : 32;
+      ps->nodes = realloc(ps->nodes, sizeof(struct regex_node) * ps->cap);
+      if (ps->nodes == NULL) die("realloc");
+   }
+   ps->nodes[ps->n].type = type;
+   ps->nodes[ps->n].a = a;
+   ps->nodes[ps->n].b = b;
+   return ps->n++;
+}
+
+// a new, empty class, returning its index
+int regex_class_new(struct regex * re)
+{
+   re->classes = realloc(re->classes, sizeof(*re->classes) * (re->nclasses + 1));
+   if (re->classes == NULL) die("realloc");
+   memset(re->classes[re->nclasses], 0, 32);
+   return re->nclasses++;
+}
+
+void regex_class_add(unsigned char * cls, int from, int to)
+{
+   for (int c = from; c <= to; c++) cls[c >> 3] |= 1 << (c & 7);
+}
+
+// adds the bytes of \d, \w or \s (or their opposites) to cls
+int regex_class_escape(unsigned char * cls, char e)
+{
+   unsigned char set[32] = { 0 };
+   switch (tolower((unsigned char)e)) {
+      case 'd': regex_class_add(set, '0', '9'); break;
+      case 'w':
+         regex_class_add(set, '0', '9');
+         regex_class_add(set, 'a', 'z');
+         regex_class_add(set, 'A', 'Z');
+         regex_class_add(set, '_', '_');
+         break;
+      case 's':
+         regex_class_add(set, ' ', ' ');
+         regex_class_add(set, '\t', '\r');
+         break;
+      default: return 0;
+   }
+   for (int i = 0; i < 32; i++) cls[i] |= isupper((unsigned char)e) ? ~set[i] : set[i];
+   return 1;
+}
+
+// the byte \e stands for, outside of the classes
+int regex_escape_byte(char e)
+{
+   if (e == 't') return '\t';
+   if (e == 'n') return '\n';
+   if (e == 'r') return '\r';
+   return (unsigned char)e;
+}
+
+// a bracket expression, from just past its [
+int regex_parse_bracket(struct regex_parser * ps)
+{
+   int c = regex_class_new(ps->re);
+   unsigned char * cls = ps->re->classes[c];
+   int negate = *ps->p == '^';
+   if (negate) ps->p++;
+   int first = 1;
+   while (*ps->p != ']' || first) {
+      first = 0;
+      if (*ps->p == '\0') {
+         ps->err = "missing ]";
+         return -1;
+      }
+      int lo = (unsigned char)*ps->p++;
+      if (lo == '\\') {
+         if (*ps->p == '\0') {
+            ps->err = "trailing \\";
+            return -1;
+         }
+         if (regex_class_escape(cls, *ps->p)) {
+            ps->p++;
+            continue;
+         }
+         lo = regex_escape_byte(*ps->p++);
+      }
+      int hi = lo;
+      if (ps->p[0] == '-' && ps->p[1] != ']' && ps->p[1] != '\0') {
+         ps->p++;
+         hi = (unsigned char)*ps->p++;
+         if (hi == '\\' && *ps->p) hi = regex_escape_byte(*ps->p++);
+         if (hi < lo) {
+            ps->err = "bad range";
+            return -1;
+         }
+      }
+      regex_class_add(cls, lo, hi);
+   }
+   ps->p++;
+   if (negate)
+      for (int i = 0; i < 32; i++) cls[i] = ~cls[i];
+   return regex_node_new(ps, RN_CLASS, c, 0);
+}
+
+int regex_parse_alt(struct regex_parser * ps);
+
+int regex_parse_atom(struct regex_parser * ps)
+{
+   char ch = *ps->p++;
+   int c;
+   switch (ch) {
+      case '(': {
+         if (++ps->depth > REGEX_DEPTH_MAX) {
+            ps->err = "too deep";
+            return -1;
+         }
+         int n = regex_parse_alt(ps);
+         if (n == -1) return -1;
+         if (*ps->p != ')') {
+            ps->err = "missing )";
+            return -1;
+         }
+         ps->p++;
+         ps->depth--;
+         return n;
+      }
+      case '[':
+         return regex_parse_bracket(ps);
+      case '^':
+         return regex_node_new(ps, RN_BOL, 0, 0);
+      case '$':
+         return regex_node_new(ps, RN_EOL, 0, 0);
+      case '*': case '+': case '?':
+         ps->err = "nothing to repeat";
+         return -1;
+      case '.':
+         c = regex_class_new(ps->re);
+         regex_class_add(ps->re->classes[c], 0, 255);
+         return regex_node_new(ps, RN_CLASS, c, 0);
+      case '\\':
+         if (*ps->p == '\0') {
+            ps->err = "trailing \\";
+            return -1;
+         }
+         c = regex_class_new(ps->re);
+         if (!regex_class_escape(ps->re->classes[c], *ps->p)) {
+            int b = regex_escape_byte(*ps->p);
+            regex_class_add(ps->re->classes[c], b, b);
+         }
+         ps->p++;
+         return regex_node_new(ps, RN_CLASS, c, 0);
+      default:
+         c = regex_class_new(ps->re);
+         regex_class_add(ps->re->classes[c], (unsigned char)ch, (unsigned char)ch);
+         return regex_node_new(ps, RN_CLASS, c, 0);
+   }
+}
+
+int regex_parse_cat(struct regex_parser * ps)
+{
+   int n = regex_node_new(ps, RN_EMPTY, 0, 0);
+   while (*ps->p && *ps->p != '|' && *ps->p != ')') {
+      int atom = regex_parse_atom(ps);
+      if (atom == -1) return -1;
+      while (*ps->p == '*' || *ps->p == '+' || *ps->p == '?') {
+         int type = *ps->p == '*' ? RN_STAR : *ps->p == '+' ? RN_PLUS : RN_QUEST;
+         atom = regex_node_new(ps, type, atom, 0);
+         ps->p++;
+      }
+      n = regex_node_new(ps, RN_CAT, n, atom);
+   }
+   return n;
+}
+
+int regex_parse_alt(struct regex_parser * ps)
+{
+   int n = regex_parse_cat(ps);
+   while (n != -1 && *ps->p == '|') {
+      ps->p++;
+      int m = regex_parse_cat(ps);
+      if (m == -1) return -1;
+      n = regex_node_new(ps, RN_ALT, n, m);
+   }
+   return n;
+}
+
+int regex_emit(struct regex_prog * prog, int op, int x, int y, int cls)
+{
+   struct regex_inst * in = &prog->inst[prog->n];
+   in->op = op;
+   in->x = x;
+   in->y = y;
+   in->cls = cls;
+   return prog->n++;
+}
+
+/* thompson's construction. backwards, everything's mirrored: the parts
+ * of a concatenation come in the other order and ^ and $ swap */
+void regex_compile(struct regex_prog * prog, struct regex_node * nodes, int i, int reverse)
+{
+   struct regex_node * node = &nodes[i];
+   int split, jmp;
+   switch (node->type) {
+      case RN_CLASS:
+         regex_emit(prog, RE_CLASS, 0, 0, node->a);
+         break;
+      case RN_CAT:
+         regex_compile(prog, nodes, reverse ? node->b : node->a, reverse);
+         regex_compile(prog, nodes, reverse ? node->a : node->b, reverse);
+         break;
+      case RN_ALT:
+         split = regex_emit(prog, RE_SPLIT, prog->n + 1, 0, 0);
+         regex_compile(prog, nodes, node->a, reverse);
+         jmp = regex_emit(prog, RE_JMP, 0, 0, 0);
+         prog->inst[split].y = prog->n;
+         regex_compile(prog, nodes, node->b, reverse);
+         prog->inst[jmp].x = prog->n;
+         break;
+      case RN_STAR:
+         split = regex_emit(prog, RE_SPLIT, prog->n + 1, 0, 0);
+         regex_compile(prog, nodes, node->a, reverse);
+         regex_emit(prog, RE_JMP, split, 0, 0);
+         prog->inst[split].y = prog->n;
+         break;
+      case RN_PLUS:
+         split = prog->n;
+         regex_compile(prog, nodes, node->a, reverse);
+         regex_emit(prog, RE_SPLIT, split, prog->n + 1, 0);
+         break;
+      case RN_QUEST:
+         split = regex_emit(prog, RE_SPLIT, prog->n + 1, 0, 0);
+         regex_compile(prog, nodes, node->a, reverse);
+         prog->inst[split].y = prog->n;
+         break;
+      case RN_BOL:
+         regex_emit(prog, reverse ? RE_EOL : RE_BOL, 0, 0, 0);
+         break;
+      case RN_EOL:
+         regex_emit(prog, reverse ? RE_BOL : RE_EOL, 0, 0, 0);
+         break;
+   }
+}
+
+void regex_free(struct regex * re)
+{
+   if (re == NULL) return;
+   free(re->fwd.inst);
+   free(re->rev.inst);
+   free(re->classes);
+   free(re);
+}
+
+/* splits the bytes into groups that no class tells apart: each class
+ * splits the groups it takes part of (but not all) in two */
+void regex_group_bytes(struct regex * re)
+{
+   memset(re->groups, 0, sizeof(re->groups));
+   re->ngroups = 1;
+   for (int k = 0; k < re->nclasses; k++) {
+      unsigned char * cls = re->classes[k];
+      int size[256] = { 0 }, in[256] = { 0 }, split[256];
+      for (int c = 0; c < 256; c++) {
+         size[re->groups[c]]++;
+         if (cls[c >> 3] & (1 << (c & 7))) in[re->groups[c]]++;
+      }
+      int ngroups = re->ngroups;
+      for (int g = 0; g < ngroups; g++)
+         split[g] = in[g] > 0 && in[g] < size[g] ? re->ngroups++ : g;
+      for (int c = 0; c < 256; c++)
+         if (cls[c >> 3] & (1 << (c & 7))) re->groups[c] = split[re->groups[c]];
+   }
+}
+
+/* compiles pattern, or returns NULL and says why in err. nothing in the
+ * pattern language backtracks, so every pattern matches in linear time */
+struct regex * regex_new(const char * pattern, const char ** err)
+{
+   struct regex * re = calloc(1, sizeof(struct regex));
+   if (re == NULL) die("calloc");
+   struct regex_parser ps = { pattern, re, NULL, 0, 0, 0, NULL };
+   int root = regex_parse_alt(&ps);
+   if (root != -1 && *ps.p == ')') ps.err = "unmatched )";
+   if (root == -1 || ps.err) {
+      *err = ps.err;
+      free(ps.nodes);
+      regex_free(re);
+      return NULL;
+   }
+
+   // each node is at most two instructions, and there's the MATCH
+   struct regex_prog * progs[2] = { &re->fwd, &re->rev };
+   for (int r = 0; r < 2; r++) {
+      progs[r]->inst = malloc(sizeof(struct regex_inst) * (ps.n * 2 + 1));
+      if (progs[r]->inst == NULL) die("malloc");
+      regex_compile(progs[r], ps.nodes, root, r);
+      regex_emit(progs[r], RE_MATCH, 0, 0, 0);
+   }
+   free(ps.nodes);
+   regex_group_bytes(re);
+   return re;
+}
+
+void regex_dfa_init(struct regex_dfa * dfa, struct regex * re, struct regex_prog * prog, int anchored)
+{
+   memset(dfa, 0, sizeof(*dfa));
+   dfa->re = re;
+   dfa->prog = prog;
+   dfa->anchored = anchored;
+   dfa->start[0] = dfa->start[1] = -1;
+   dfa->states = malloc(sizeof(struct dfa_state) * REGEX_DFA_STATES);
+   dfa->table = malloc(sizeof(int) * REGEX_DFA_STATES * 2);
+   dfa->mark = calloc(prog->n, 1);
+   dfa->stack = malloc(sizeof(int) * (prog->n * 2 + 1));
+   dfa->set = malloc(sizeof(int) * prog->n);
+   if (!dfa->states || !dfa->table || !dfa->mark || !dfa->stack || !dfa->set) die("malloc");
+   for (int i = 0; i < REGEX_DFA_STATES * 2; i++) dfa->table[i] = -1;
+}
+
+// throws away every state
+void regex_dfa_clear(struct regex_dfa * dfa)
+{
+   for (int s = 0; s < dfa->nstates; s++) free(dfa->states[s].next);
+   dfa->nstates = 0;
+   dfa->mem = 0;
+   dfa->clears++;
+   dfa->start[0] = dfa->start[1] = -1;
+   for (int i = 0; i < REGEX_DFA_STATES * 2; i++) dfa->table[i] = -1;
+}
+
+void regex_dfa_free(struct regex_dfa * dfa)
+{
+   if (dfa->states == NULL) return;
+   regex_dfa_clear(dfa);
+   free(dfa->states);
+   free(dfa->table);
+   free(dfa->mark);
+   free(dfa->stack);
+   free(dfa->set);
+   dfa->states = NULL;
+}
+
+/* marks what pc leads to without stepping over a byte. bol is whether
+ * this is the start of the line, where ^ holds */
+void regex_dfa_close(struct regex_dfa * dfa, int pc, int bol)
+{
+   struct regex_inst * inst = dfa->prog->inst;
+   int top = 0;
+   dfa->stack[top++] = pc;
+   while (top > 0) {
+      pc = dfa->stack[--top];
+      if (dfa->mark[pc]) continue;
+      dfa->mark[pc] = 1;
+      switch (inst[pc].op) {
+         case RE_JMP:
+            dfa->stack[top++] = inst[pc].x;
+            break;
+         case RE_SPLIT:
+            dfa->stack[top++] = inst[pc].y;
+            dfa->stack[top++] = inst[pc].x;
+            break;
+         case RE_BOL:
+            if (bol) dfa->stack[top++] = pc + 1;
+            break;
+      }
+   }
+}
+
+// whether a thread at pc, where the line ends, gets to MATCH
+int regex_dfa_matches_at_eol(struct regex_dfa * dfa, int pc)
+{
+   struct regex_inst * inst = dfa->prog->inst;
+   unsigned char * seen = calloc(dfa->prog->n, 1);
+   if (seen == NULL) die("calloc");
+   int top = 0;
+   int match = 0;
+   dfa->stack[top++] = pc;
+   while (top > 0 && !match) {
+      pc = dfa->stack[--top];
+      if (seen[pc]) continue;
+      seen[pc] = 1;
+      switch (inst[pc].op) {
+         case RE_MATCH: match = 1; break;
+         case RE_EOL: dfa->stack[top++] = pc + 1; break;
+         case RE_JMP: dfa->stack[top++] = inst[pc].x; break;
+         case RE_SPLIT:
+            dfa->stack[top++] = inst[pc].y;
+            dfa->stack[top++] = inst[pc].x;
+            break;
+      }
+   }
+   free(seen);
+   return match;
+}
+
+/* the state for the instructions marked, made if there isn't one. only
+ * the ones that do something on their own (step over a byte, wait for
+ * the end of the line, match) tell states apart, so only they're kept */
+int regex_dfa_state(struct regex_dfa * dfa)
+{
+   struct regex_inst * inst = dfa->prog->inst;
+   int n = 0;
+   unsigned int hash = 2166136261u;
+   for (int pc = 0; pc < dfa->prog->n; pc++) {
+      if (!dfa->mark[pc]) continue;
+      dfa->mark[pc] = 0;
+      int op = inst[pc].op;
+      if (op != RE_CLASS && op != RE_EOL && op != RE_MATCH) continue;
+      dfa->set[n++] = pc;
+      hash = (hash ^ pc) * 16777619u;
+   }
+
+   int mask = REGEX_DFA_STATES * 2 - 1;
+   int slot = hash & mask;
+   for (; dfa->table[slot] != -1; slot = (slot + 1) & mask) {
+      struct dfa_state * st = &dfa->states[dfa->table[slot]];
+      if (st->n == n && memcmp(st->pcs, dfa->set, sizeof(int) * n) == 0)
+         return dfa->table[slot];
+   }
+   size_t size = sizeof(int) * (n + dfa->re->ngroups);
+   if (dfa->nstates == REGEX_DFA_STATES || dfa->mem + size > REGEX_DFA_MEM) {
+      regex_dfa_clear(dfa);
+      slot = hash & mask;
+   }
+
+   struct dfa_state * st = &dfa->states[dfa->nstates];
+   st->next = malloc(size);
+   if (st->next == NULL) die("malloc");
+   st->pcs = &st->next[dfa->re->ngroups];
+   memcpy(st->pcs, dfa->set, sizeof(int) * n);
+   dfa->mem += size;
+   st->n = n;
+   st->match = 0;
+   st->match_eol = 0;
+   for (int i = 0; i < n; i++) {
+      if (inst[dfa->set[i]].op == RE_MATCH) st->match = 1;
+      else if (inst[dfa->set[i]].op == RE_EOL && !st->match_eol)
+         st->match_eol = regex_dfa_matches_at_eol(dfa, dfa->set[i]);
+   }
+   st->match_eol |= st->match;
+   for (int g = 0; g < dfa->re->ngroups; g++) st->next[g] = -1;
+   dfa->table[slot] = dfa->nstates;
+   return dfa->nstates++;
+}
+
+// the state a line starts in, bol if it's the start of the line
+int regex_dfa_start(struct regex_dfa * dfa, int bol)
+{
+   if (dfa->start[bol] == -1) {
+      regex_dfa_close(dfa, 0, bol);
+      dfa->start[bol] = regex_dfa_state(dfa);
+   }
+   return dfa->start[bol];
+}
+
+// builds the step from state s over byte c
+int regex_dfa_step(struct regex_dfa * dfa, int s, unsigned char c)
+{
+   struct dfa_state * st = &dfa->states[s];
+   struct regex_inst * inst = dfa->prog->inst;
+   for (int i = 0; i < st->n; i++) {
+      struct regex_inst * in = &inst[st->pcs[i]];
+      if (in->op == RE_CLASS && (dfa->re->classes[in->cls][c >> 3] & (1 << (c & 7))))
+         regex_dfa_close(dfa, st->pcs[i] + 1, 0);
+   }
+   if (!dfa->anchored) regex_dfa_close(dfa, 0, 0);
+   int clears = dfa->clears;
+   int next = regex_dfa_state(dfa);
+   // if the states were thrown away to make room, s went with them
+   if (dfa->clears == clears) dfa->states[s].next[dfa->re->groups[c]] = next;
+   return next;
+}
+
+void regex_nfa_init(struct regex_nfa * nfa, struct regex_prog * prog)
+{
+   memset(nfa, 0, sizeof(*nfa));
+   nfa->prog = prog;
+   nfa->list[0] = malloc(sizeof(struct regex_thread) * prog->n);
+   nfa->list[1] = malloc(sizeof(struct regex_thread) * prog->n);
+   nfa->seen = calloc(prog->n, sizeof(int));
+   nfa->stack = malloc(sizeof(int) * (prog->n * 2 + 1));
+   if (!nfa->list[0] || !nfa->list[1] || !nfa->seen || !nfa->stack) die("malloc");
+}
+
+void regex_nfa_free(struct regex_nfa * nfa)
+{
+   free(nfa->list[0]);
+   free(nfa->list[1]);
+   free(nfa->seen);
+   free(nfa->stack);
+   free(nfa->longest);
+}
+
+/* adds a thread at pc to list l, and the ones it leads to without
+ * stepping over a byte, leaving out instructions already gone through
+ * this step. bol and eol are whether the reversed line starts (the line
+ * ends) or ends here */
+void regex_nfa_add(struct regex_nfa * nfa, int l, int pc, int end, int bol, int eol)
+{
+   struct regex_inst * inst = nfa->prog->inst;
+   int top = 0;
+   nfa->stack[top++] = pc;
+   while (top > 0) {
+      pc = nfa->stack[--top];
+      if (nfa->seen[pc] == nfa->gen) continue;
+      nfa->seen[pc] = nfa->gen;
+      switch (inst[pc].op) {
+         case RE_JMP:
+            nfa->stack[top++] = inst[pc].x;
+            break;
+         case RE_SPLIT:
+            nfa->stack[top++] = inst[pc].y;
+            nfa->stack[top++] = inst[pc].x;
+            break;
+         case RE_BOL:
+            if (bol) nfa->stack[top++] = pc + 1;
+            break;
+         case RE_EOL:
+            if (eol) nfa->stack[top++] = pc + 1;
+            break;
+         default:
+            nfa->list[l][nfa->n[l]++] = (struct regex_thread){ pc, end };
+      }
+   }
+}
+
+void regex_matcher_init(struct regex_matcher * rm, struct regex * re)
+{
+   regex_dfa_init(&rm->find, re, &re->fwd, 0);
+   regex_dfa_init(&rm->starts, re, &re->rev, 0);
+   regex_dfa_init(&rm->longest, re, &re->fwd, 1);
+   regex_nfa_init(&rm->nfa, &re->rev);
+   rm->empty = rm->one = 0;
+   rm->cancel = NULL;
+   rm->starts_at = NULL;
+   rm->text = NULL;
+   rm->starts_cap = rm->text_cap = 0;
+}
+
+void regex_matcher_free(struct regex_matcher * rm)
+{
+   regex_dfa_free(&rm->find);
+   regex_dfa_free(&rm->starts);
+   regex_dfa_free(&rm->longest);
+   regex_nfa_free(&rm->nfa);
+   free(rm->starts_at);
+   free(rm->text);
+}
+
+static inline int regex_dfa_next(struct regex_dfa * dfa, int s, unsigned char c)
+{
+   int next = dfa->states[s].next[dfa->re->groups[c]];
+   return next != -1 ? next : regex_dfa_step(dfa, s, c);
+}
+
+// whether the search rm is for has been called off
+static inline int regex_cancelled(struct regex_matcher * rm)
+{
+   return rm->cancel && __atomic_load_n(rm->cancel, __ATOMIC_RELAXED);
+}
+
+/* the matches of line s (n bytes) from from on, as regex_search_line
+ * finds them, last being where the one before ended (or -1). it's one
+ * pass backwards over the line: the reversed pattern
+ * has a thread started at every byte, knowing where its match ends; of
+ * threads at the same instruction only the one that started first (ends
+ * furthest on) is kept, since from there on they reach the same starts.
+ * that leaves the longest match from every start, and the matches are
+ * then picked from the left */
+void regex_nfa_search(struct regex_matcher * rm, const char * s, int n, int from, int last,
+      struct search_chunk * chunk, int row)
+{
+   struct regex_nfa * nfa = &rm->nfa;
+   struct regex_inst * inst = nfa->prog->inst;
+   unsigned char (*classes)[32] = rm->starts.re->classes;
+   if (n + 1 > nfa->longest_cap) {
+      nfa->longest_cap = n + 1;
+      nfa->longest = realloc(nfa->longest, sizeof(int) * nfa->longest_cap);
+      if (nfa->longest == NULL) die("realloc");
+   }
+   if (nfa->gen > INT_MAX / 2) {
+      memset(nfa->seen, 0, sizeof(int) * nfa->prog->n);
+      nfa->gen = 0;
+   }
+
+   // threads stay in order of where they started, latest last
+   int l = 0;
+   nfa->n[l] = 0;
+   for (int j = n; j >= from; j--) {
+      if (((n - j) & 0xffff) == 0xffff && regex_cancelled(rm)) return;
+      nfa->gen++;
+      if (j < n) {
+         unsigned char c = s[j];
+         nfa->n[l ^ 1] = 0;
+         for (int t = 0; t < nfa->n[l]; t++) {
+            struct regex_thread * th = &nfa->list[l][t];
+            struct regex_inst * in = &inst[th->pc];
+            if (in->op == RE_CLASS && (classes[in->cls][c >> 3] & (1 << (c & 7))))
+               regex_nfa_add(nfa, l ^ 1, th->pc + 1, th->end, 0, j == 0);
+         }
+         l ^= 1;
+      }
+      regex_nfa_add(nfa, l, 0, j, j == n, j == 0);
+
+      nfa->longest[j] = -1;
+      for (int t = 0; t < nfa->n[l]; t++) {
+         struct regex_thread * th = &nfa->list[l][t];
+         if (inst[th->pc].op != RE_MATCH) continue;
+         nfa->longest[j] = th->end;
+         break;
+      }
+   }
+
+   for (int i = from; i <= n; ) {
+      int end = nfa->longest[i];
+      if (end > i || (end == i && rm->empty && i != last)) {
+         search_push(chunk, row, i, end - i);
+         if (rm->one) return;
+         last = end;
+         if (end > i) {
+            i = end;
+            continue;
+         }
+      }
+      i++;
+   }
+}
+
+/* pushes the matches of line s (n bytes), row row, onto chunk: leftmost,
+ * longest and not overlapping, empty ones left out unless rm->empty. the dfas go over
+ * each byte once, except that the run from each start goes on until the
+ * match can't be any longer; a line where that goes over the same bytes
+ * too often is finished off by regex_nfa_search */
+void regex_search_line(struct regex_matcher * rm, const char * s, int n,
+      struct search_chunk * chunk, int row)
+{
+   // only on an empty line can $ come before ^, which the dfas don't follow
+   if (n == 0) {
+      regex_nfa_search(rm, s, 0, 0, -1, chunk, row);
+      return;
+   }
+
+   // most lines don't match at all, which going forwards once tells
+   struct regex_dfa * dfa = &rm->find;
+   int st = regex_dfa_start(dfa, 1);
+   int any = dfa->states[st].match;
+   for (int i = 0; i < n && !any; i++) {
+      if ((i & 0xffff) == 0xffff && regex_cancelled(rm)) return;
+      st = regex_dfa_next(dfa, st, s[i]);
+      any = dfa->states[st].match;
+   }
+   if (!any && !dfa->states[st].match_eol) return;
+
+   // going backwards, the reversed pattern matching at i means a match
+   // starts there
+   if (n + 1 > rm->starts_cap) {
+      rm->starts_cap = n + 1;
+      rm->starts_at = realloc(rm->starts_at, rm->starts_cap);
+      if (rm->starts_at == NULL) die("realloc");
+   }
+   dfa = &rm->starts;
+   st = regex_dfa_start(dfa, 1);
+   for (int i = n; i > 0; i--) {
+      rm->starts_at[i] = dfa->states[st].match;
+      st = regex_dfa_next(dfa, st, s[i - 1]);
+   }
+   rm->starts_at[0] = dfa->states[st].match_eol;
+
+   dfa = &rm->longest;
+   long budget = (long)n + REGEX_RERUN_MAX;
+   int from = 0;
+   int last = -1;
+   for (int i = 0; i < n + rm->empty; i++) {
+      if (!rm->starts_at[i] || i < from) continue;
+      if (regex_cancelled(rm)) return;
+      st = regex_dfa_start(dfa, i == 0);
+      int end = -1;
+      int j;
+      for (j = i; ; j++) {
+         struct dfa_state * ds = &dfa->states[st];
+         if (j == n ? ds->match_eol : ds->match) end = j;
+         if (j == n || ds->n == 0) break;
+         st = regex_dfa_next(dfa, st, s[j]);
+      }
+      if (end > i || (end == i && rm->empty && i != last)) {
+         search_push(chunk, row, i, end - i);
+         if (rm->one) return;
+         from = last = end;
+      }
+      // the bytes between the match's end and where the run stopped get
+      // gone over again by the next run
+      budget -= j - (end > i ? end : i);
+      if (budget < 0) {
+         regex_nfa_search(rm, s, n, end > i ? end : i + 1, last, chunk, row);
+         return;
+      }
+   }
+}
+
+// the text of row in one piece, copied out if the gap is in the way
+const char * regex_row_text(struct regex_matcher * rm, erow * row)
+{
+   if (row->gaplen == 0 || row->gap == row->size) return row->chars;
+   if (row->size > rm->text_cap) {
+      rm->text_cap = row->size;
+      rm->text = realloc(rm->text, rm->text_cap);
+      if (rm->text == NULL) die("realloc");
+   }
+   memcpy(rm->text, row->chars, row->gap);
+   memcpy(&rm->text[row->gap], &row->chars[row->gap + row->gaplen], row->size - row->gap);
+   return rm->text;
+}
+
+/* first place in [from, to) that q starts at in row, or -1. the two
+ * sides of the gap are searched where they lie, and the bytes around it
+ * copied together, so the row isn't touched and can be searched from a
+ * worker */
+int search_row(erow * row, int from, int to, const char * q, int m)
+{
+   int gap = row->gap;
+   int tail = row->size - gap;
+   const char * after = &row->chars[gap + row->gaplen];
+   // where a match starting before to can end
+   int end = to < row->size - m + 1 ? to + m - 1 : row->size;
+   if (row->gaplen == 0 || tail == 0) gap = row->size;
+   if (gap == row->size) {
+      if (from >= to || from > row->size) return -1;
+      int k = search_find(row->chars + from, end - from, q, m);
+      return k == -1 ? -1 : from + k;
+   }
+
+   if (from < gap && from < to) {
+      int k = search_find(row->chars + from, (end < gap ? end : gap) - from, q, m);
+      if (k != -1) return from + k;
+
+      // a match running over the gap starts in its last m - 1 bytes
+      int before = m - 1 < gap - from ? m - 1 : gap - from;
+      int past = m - 1 < tail ? m - 1 : tail;
+      if (before > 0 && past > 0 && gap - before < to) {
+         char seam_buf[256];
+         char * seam = before + past <= (int)sizeof(seam_buf) ? seam_buf : malloc(before + past);
+         if (seam == NULL) die("malloc");
+         memcpy(seam, &row->chars[gap - before], before);
+         memcpy(&seam[before], after, past);
+         k = search_find(seam, before + past, q, m);
+         if (seam != seam_buf) free(seam);
+         if (k != -1 && gap - before + k < to) return gap - before + k;
+      }
+      from = gap;
+   }
+   if (from >= to || end <= from) return -1;
+   int k = search_find(after + (from - gap), end - from, q, m);
+   return k == -1 ? -1 : from + k;
+}
+
+// whether q occurs exactly at col of row i of leaf
+int search_match_at(struct row_node * leaf, int i, int col, const char * q, int m)
+{
+   if (leaf->lazy) {
+      int len;
+      char * line = editor_map_line(leaf->u.offs[i], leaf->u.offs[i + 1], &len);
+      return col + m <= len && memcmp(&line[col], q, m) == 0;
+   }
+   erow * row = &leaf->u.rows[i];
+   if (col + m > row->size) return 0;
+   for (int j = 0; j < m; j++)
+      if (editor_row_char(row, col + j) != q[j]) return 0;
+   return 1;
+}
+
+/* collects where q occurs in rows [pos, end) of leaf, whose first row is
+ * row base. the lines of a lazy leaf sit next to each other in the map,
+ * so they're searched as one block; the query has no newlines, so a
+ * match never runs from one line into the next. either way it goes a
+ * slice at a time, giving up once cancel is set. with rm, q is a regex
+ * and the lines are gone through one by one */
+void search_leaf(struct search_chunk * chunk, struct row_node * leaf, int base,
+      int pos, int end, const char * q, int m, struct regex_matcher * rm,
+      const int * cancel)
+{
+   if (rm) {
+      for (int i = pos; i < end; i++) {
+         int len;
+         const char * line;
+         if (leaf->lazy) {
+            line = editor_map_line(leaf->u.offs[i], leaf->u.offs[i + 1], &len);
+         } else {
+            line = regex_row_text(rm, &leaf->u.rows[i]);
+            len = leaf->u.rows[i].size;
+         }
+         regex_search_line(rm, line, len, chunk, base + i);
+      }
+      return;
+   }
+   if (leaf->lazy) {
+      off_t from = leaf->u.offs[pos];
+      const char * block = &E.map[from];
+      off_t n = leaf->u.offs[end] - from;
+      off_t at = 0;
+      int i = pos;
+      while (at < n && !__atomic_load_n(cancel, __ATOMIC_RELAXED)) {
+         // the slice takes in every match starting in its first SEARCH_SLICE bytes
+         off_t len = n - at;
+         if (len > SEARCH_SLICE + m - 1) len = SEARCH_SLICE + m - 1;
+         int k = search_find(block + at, len, q, m);
+         if (k == -1) {
+            at += SEARCH_SLICE;
+            continue;
+         }
+         off_t off = from + at + k;
+         while (leaf->u.offs[i + 1] <= off) i++;
+         search_push(chunk, base + i, off - leaf->u.offs[i], m);
+         at += k + 1;
+      }
+      return;
+   }
+   for (int i = pos; i < end; i++) {
+      erow * row = &leaf->u.rows[i];
+      for (long long from = 0; from < row->size; from += SEARCH_SLICE) {
+         if (__atomic_load_n(cancel, __ATOMIC_RELAXED)) return;
+         int to = row->size - from > SEARCH_SLICE ? from + SEARCH_SLICE : row->size;
+         int col = from;
+         while ((col = search_row(row, col, to, q, m)) != -1) {
+            search_push(chunk, base + i, col, m);
+            col++;
+         }
+      }
+   }
+}
+
+/* searches one chunk. the tree is only read under the leaf lock, a leaf
+ * at a time, so the main thread can load leaves (to draw them) between
+ * them; where the search is up to is kept as a row, not a leaf */
+void search_chunk_run(struct search_state * st, struct search_chunk * chunk,
+      struct regex_matcher * rm)
+{
+   const char * q = st->query;
+   int m = st->qlen;
+   int at = chunk->from;
+   while (at < chunk->to && !__atomic_load_n(&st->cancel, __ATOMIC_RELAXED)) {
+      pthread_rwlock_rdlock(&E.leaf_lock);
+      int pos;
+      if (st->prev) {
+         struct row_node * leaf = row_tree_locate(st->prev[at].row, &pos);
+         int base = st->prev[at].row - pos;
+         for (; at < chunk->to && st->prev[at].row < base + leaf->n; at++) {
+            struct search_match * mt = &st->prev[at];
+            if (search_match_at(leaf, mt->row - base, mt->col, q, m))
+               search_push(chunk, mt->row, mt->col, m);
+         }
+      } else {
+         struct row_node * leaf = row_tree_locate(at, &pos);
+         int end = leaf->n;
+         if (end - pos > chunk->to - at) end = pos + chunk->to - at;
+         search_leaf(chunk, leaf, at - pos, pos, end, q, m, rm, &st->cancel);
+         at += end - pos;
       }
+      pthread_rwlock_unlock(&E.leaf_lock);
    }
+   __atomic_store_n(&chunk->done, 1, __ATOMIC_RELEASE);
 }
 
-void editor_update_row(erow * row)
+// a worker takes the next chunk nobody has until there are none left
+void * search_worker(void * arg)
 {
-   int tabs = 0;
-   int j;
-
-   for (j = 0; j < row->size; j++)
-      if (row->chars[j] == '\t') tabs++;
-
-   free(row->render);
-   row->render = malloc(row->size + tabs * (E.tab_stop - 1) + 1);
-
-   int idx = 0;
-   for (j = 0; j < row->size; j++) {
-      if (row->chars[j] == '\t') {
-         row->render[idx++] = ' ';
-         while (idx % E.tab_stop != 0) row->render[idx++] = ' ';
-      } else {
-         row->render[idx++] = row->chars[j];
-      }
+   struct search_state * st = arg;
+   // the dfas are built as they're run, so each worker has its own
+   struct regex_matcher rm;
+   if (st->re) {
+      regex_matcher_init(&rm, st->re);
+      rm.cancel = &st->cancel;
    }
-   row->render[idx] = '\0';
-   row->rsize = idx;
-
-   editor_update_syntax(row);
+   int c;
+   while ((c = __atomic_fetch_add(&st->next_chunk, 1, __ATOMIC_RELAXED)) < st->nchunks) {
+      if (__atomic_load_n(&st->cancel, __ATOMIC_RELAXED)) break;
+      search_chunk_run(st, &st->chunks[c], st->re ? &rm : NULL);
+   }
+   if (st->re) regex_matcher_free(&rm);
+   return NULL;
 }
 
-void editor_insert_row(int at, char * s, size_t len)
+// waits for the workers to be done, and lets go of the chunks
+void search_join(struct search_state * st)
 {
-   if (at < 0 || at > E.numrows) return;
-
-   E.row = realloc(E.row, sizeof(erow) * (E.numrows + 1));
-   memmove(&E.row[at + 1], &E.row[at], sizeof(erow) * (E.numrows - at));
-   for (int j = at + 1; j <= E.numrows; j++) E.row[j].idx++;
-
-   E.row[at].idx = at;
-
-   E.row[at].size = len;
-   E.row[at].chars = malloc(len + 1);
-   memcpy(E.row[at].chars, s, len);
-   E.row[at].chars[len] = '\0';
-
-   E.row[at].rsize = 0;
-   E.row[at].render = NULL;
-   E.row[at].hl = NULL;
-   E.row[at].hl_open_comment = 0;
-   editor_update_row(&E.row[at]);
-
-   E.numrows++;
-   E.dirty++;
+   for (int t = 0; t < st->nthreads; t++) pthread_join(st->threads[t], NULL);
+   free(st->threads);
+   st->threads = NULL;
+   st->nthreads = 0;
+   for (int c = st->merged; c < st->nchunks; c++) free(st->chunks[c].found);
+   free(st->chunks);
+   st->chunks = NULL;
+   st->nchunks = 0;
+   st->merged = 0;
+   free(st->prev);
+   st->prev = NULL;
+   st->running = 0;
 }
 
-void editor_free_row(erow * row)
+// calls off a long row's job, if there is one, and lets go of it
+void search_row_job_stop()
 {
-   free(row->render);
-   free(row->chars);
-   free(row->hl);
+   struct search_row_job * job = &E.search.row_job;
+   if (!job->active) return;
+   __atomic_store_n(&job->cancel, 1, __ATOMIC_RELAXED);
+   pthread_join(job->thread, NULL);
+   free(job->text);
+   free(job->found.found);
+   memset(job, 0, sizeof(*job));
 }
 
-void editor_del_row(int at)
+// calls off the scan (and a long row's job), if one's going
+void editor_search_stop()
 {
-   if (at < 0 || at >= E.numrows) return;
-   editor_free_row(&E.row[at]);
-   memmove(&E.row[at], &E.row[at + 1], sizeof(erow) * (E.numrows - at - 1));
-   for (int j = at; j < E.numrows - 1; j++) E.row[j].idx--;
-   E.numrows--;
-   E.dirty++;
+   struct search_state * st = &E.search;
+   search_row_job_stop();
+   if (!st->running) return;
+   __atomic_store_n(&st->cancel, 1, __ATOMIC_RELAXED);
+   search_join(st);
 }
 
-void editor_row_insert_char(erow * row, int at, int c)
+/* moves the chunks finished so far, in order, onto the end of matches.
+ * returns whether any were */
+int editor_search_merge()
 {
-   if (at < 0 || at > row->size) at = row->size;
-   row->chars = realloc(row->chars, row->size + 2);
-   memmove(&row->chars[at + 1], &row->chars[at], row->size - at + 1);
-   row->size++;
-   row->chars[at] = c;
-   editor_update_row(row);
-   E.dirty++;
+   struct search_state * st = &E.search;
+   if (!st->running) return 0;
+   int merged = 0;
+   while (st->merged < st->nchunks &&
+         __atomic_load_n(&st->chunks[st->merged].done, __ATOMIC_ACQUIRE)) {
+      struct search_chunk * chunk = &st->chunks[st->merged];
+      if (st->nmatches + chunk->nfound > st->cap) {
+         while (st->nmatches + chunk->nfound > st->cap) st->cap = st->cap ? st->cap * 2 : 256;
+         st->matches = realloc(st->matches, sizeof(struct search_match) * st->cap);
+         if (st->matches == NULL) die("realloc");
+      }
+      memcpy(&st->matches[st->nmatches], chunk->found, sizeof(struct search_match) * chunk->nfound);
+      st->nmatches += chunk->nfound;
+      free(chunk->found);
+      st->merged++;
+      merged = 1;
+   }
+   if (st->merged == st->nchunks) search_join(st);
+   return merged;
 }
 
-void editor_row_append_string(erow * row, char * s, size_t len)
+// lets go of the compiled query, and what was built to match it
+void editor_search_regex_free()
 {
-   row->chars = realloc(row->chars, row->size + len + 1);
-   memcpy(&row->chars[row->size], s, len);
-   row->size += len;
-   row->chars[row->size] = '\0';
-   editor_update_row(row);
-   E.dirty++;
+   struct search_state * st = &E.search;
+   if (st->matcher.find.states) regex_matcher_free(&st->matcher);
+   memset(&st->matcher, 0, sizeof(st->matcher));
+   regex_free(st->re);
+   st->re = NULL;
+   st->error = NULL;
 }
 
-void editor_row_del_char(erow * row, int at) {
-   if (at < 0 || at >= row->size) return;
-   memmove(&row->chars[at], &row->chars[at + 1], row->size - at);
-   row->size--;
-   editor_update_row(row);
-   E.dirty++;
+// puts the cursor on match idx
+void editor_search_goto(int idx)
+{
+   struct search_state * st = &E.search;
+   st->current = idx;
+   E.cy = st->matches[idx].row;
+   E.cx = st->matches[idx].col;
+   E.rowoff = E.numrows;
 }
 
-void editor_insert_char(int c)
+/* copies the matches the workers found in row at to found. returns 0 if
+ * they haven't got that far yet */
+int editor_search_row_found(int at, struct search_chunk * found)
 {
-   if (E.cy == E.numrows) {
-      editor_insert_row(E.numrows, "", 0);
+   struct search_state * st = &E.search;
+   if (st->running) {
+      struct search_chunk * next = &st->chunks[st->merged];
+      if (at >= (st->prev ? st->prev[next->from].row : next->from)) return 0;
    }
-   editor_row_insert_char(&E.row[E.cy], E.cx, c);
-   E.cx++;
+
+   int lo = 0, hi = st->nmatches;
+   while (lo < hi) {
+      int mid = lo + (hi - lo) / 2;
+      if (st->matches[mid].row < at) lo = mid + 1;
+      else hi = mid;
+   }
+   for (; lo < st->nmatches && st->matches[lo].row == at; lo++)
+      search_push(found, at, st->matches[lo].col, st->matches[lo].len);
+   return 1;
 }
 
-void editor_insert_newline()
+// finds the query in a long row's text, on the job's own thread
+void * search_row_job_run(void * arg)
 {
-   int padding = 0;
-   if (E.cx == 0) {
-      editor_insert_row(E.cy, "", 0);
+   struct search_row_job * job = arg;
+   struct search_state * st = &E.search;
+   if (st->re) {
+      struct regex_matcher rm;
+      regex_matcher_init(&rm, st->re);
+      rm.cancel = &job->cancel;
+      regex_search_line(&rm, job->text, job->len, &job->found, 0);
+      regex_matcher_free(&rm);
    } else {
-      erow * row = &E.row[E.cy];
-      
-      int numspaces = 0, numtabs = 0;
-      for (int i = 0; row->chars[i] == ' ' || row->chars[i] == '\t'; i++) {
-         if (row->chars[i] == ' ') numspaces++;
-         else numtabs++;
-      }
-      padding = (numtabs + (numspaces / E.tab_stop));
-      if (E.tabs_as_spaces == 1) padding *= E.tab_stop;
-
-      char newline[padding + row->size - E.cx + 1];
-      if (E.tabs_as_spaces == 1) {
-         snprintf(newline, sizeof(newline), "%*c", padding, ' ');
-      } else {
-         for (int i = 0; i < padding; i++) {
-            strcat(newline, "\t");
+      // a slice at a time, as in a lazy leaf
+      const char * q = st->query;
+      int m = st->qlen;
+      long long at = 0;
+      while (at < job->len && !__atomic_load_n(&job->cancel, __ATOMIC_RELAXED)) {
+         int len = job->len - at;
+         if (len > SEARCH_SLICE + m - 1) len = SEARCH_SLICE + m - 1;
+         int k = search_find(job->text + at, len, q, m);
+         if (k == -1) {
+            at += SEARCH_SLICE;
+            continue;
          }
+         search_push(&job->found, 0, at + k, m);
+         at += k + 1;
       }
-      strcat(newline, &row->chars[E.cx]);
-      newline[padding + row->size - E.cx] = '\0';
-      editor_insert_row(E.cy + 1, newline, padding + row->size - E.cx);
-      row = &E.row[E.cy];
-      row->size = E.cx;
-      row->chars[row->size] = '\0';
-      editor_update_row(row);
    }
-   E.cy++;
-   E.cx = padding;
+   __atomic_store_n(&job->done, 1, __ATOMIC_RELEASE);
+   return NULL;
 }
 
-void editor_del_char()
+/* the matches of long row once the search is kept. a worker looks for
+ * them in a copy of its text, one row at a time; returns 0 until the
+ * one for row is done, and they're in found */
+int editor_search_row_job(erow * row, struct search_chunk * found)
 {
-   if (E.cy == E.numrows) return;
-   if (E.cx == 0 && E.cy == 0) return;
+   struct search_row_job * job = &E.search.row_job;
+   if (job->active) {
+      int mine = job->slot == row->rslot && job->tag == row->rtag;
+      int done = __atomic_load_n(&job->done, __ATOMIC_ACQUIRE);
+      if (mine && done) {
+         struct search_chunk spare = *found;
+         *found = job->found;
+         job->found = spare;
+         search_row_job_stop();
+         return 1;
+      }
+      // one for a row edited since, or done and not asked for, makes way
+      if (mine || (!done && E.rcache[job->slot].tag == job->tag)) return 0;
+      search_row_job_stop();
+   }
 
-   erow * row = &E.row[E.cy];
-   if (E.cx > 0) {
-      editor_row_del_char(row, E.cx - 1);
-      E.cx--;
-   } else {
-      E.cx = E.row[E.cy - 1].size;
-      editor_row_append_string(&E.row[E.cy - 1], row->chars, row->size);
-      editor_del_row(E.cy);
-      E.cy--;
+   job->text = malloc(row->size ? row->size : 1);
+   if (job->text == NULL) die("malloc");
+   memcpy(job->text, row->chars, row->gap);
+   memcpy(&job->text[row->gap], &row->chars[row->gap + row->gaplen], row->size - row->gap);
+   job->len = row->size;
+   job->slot = row->rslot;
+   job->tag = row->rtag;
+   job->active = 1;
+   if (pthread_create(&job->thread, NULL, search_row_job_run, job) != 0) {
+      // without a worker, it's done here
+      search_row_job_run(job);
+      struct search_chunk spare = *found;
+      *found = job->found;
+      job->found = spare;
+      free(job->text);
+      free(job->found.found);
+      memset(job, 0, sizeof(*job));
+      return 1;
    }
+   editor_timer_set(editor_search_poll, SEARCH_POLL_MS);
+   return 0;
 }
 
-char * editor_rows_to_string(int * buflen)
+/* the entry of row at, already refreshed, with the spans of it the query
+ * covers. they're looked for once per query and row: rows that weren't
+ * edited keep theirs through redraws and scrolling. overlapping matches
+ * are joined, then turned into rendered columns in one walk of the row */
+struct render_entry * editor_row_matches(int at)
 {
-   int totlen = 0;
-   int j;
-   for (j = 0; j < E.numrows; j++)
-      totlen += E.row[j].size + 1;
-   *buflen = totlen;
-
-   char * buf = malloc(totlen);
-   char * p = buf;
-   for (j = 0; j < E.numrows; j++) {
-      memcpy(p, E.row[j].chars, E.row[j].size);
-      p += E.row[j].size;
-      *p = '\n';
-      p++;
+   struct search_state * st = &E.search;
+   erow * row = editor_row_at(at);
+   struct render_entry * e = render_cache_get(row);
+   if (e->match_gen == st->gen) return e;
+   e->match_gen = st->gen;
+   e->nspans = 0;
+   if (st->query == NULL || st->qlen == 0 || st->error) return e;
+
+   struct search_chunk * found = &st->row_found;
+   found->nfound = 0;
+   if (row->size > SEARCH_HL_ROW_MAX) {
+      // looked at again on the next frame, until a worker has them
+      int ready = st->kept ? editor_search_row_job(row, found) : editor_search_row_found(at, found);
+      if (!ready) e->match_gen = 0;
+   } else if (st->re) {
+      if (st->matcher.find.states == NULL) regex_matcher_init(&st->matcher, st->re);
+      regex_search_line(&st->matcher, regex_row_text(&st->matcher, row), row->size, found, at);
+   } else {
+      int col = 0;
+      while ((col = search_row(row, col, row->size, st->query, st->qlen)) != -1) {
+         search_push(found, at, col, st->qlen);
+         col++;
+      }
    }
 
-   return buf;
-}
-
-void editor_force_quit() {
-   write(STDOUT_FILENO, "\x1b[2J", 4);
-   write(STDOUT_FILENO, "\x1b[H", 3);
-   exit(0);
-}
-
-void editor_quit(int * quit_times) {
-   if (E.dirty) {
-      // if our file is dirty we have 2 options
-      // one, we tried to quit with CTRL+Q. then quit_times will be valid. warn to press again
-      // otherwise, we did :q and we should advise to save or q!
-      if (quit_times != NULL) {
-         if (*quit_times > 0) {
-            editor_set_status_message("WARNING: Unsaved changes. Press again to force quit.");
-            *quit_times = *quit_times - 1;
-            return;
-         }
-      } else {
-         editor_set_status_message("WARNING: Unsaved changes. Use ':wq' to save & quit or ':q!' to force quit.");
-         return;
+   int cx = 0, rx = 0;
+   int k = 0;
+   while (k < found->nfound) {
+      int from = found->found[k].col;
+      int to = from + found->found[k].len;
+      for (k++; k < found->nfound && found->found[k].col <= to; k++)
+         if (found->found[k].col + found->found[k].len > to)
+            to = found->found[k].col + found->found[k].len;
+
+      if (e->nspans * 2 + 2 > e->spancap) {
+         e->spancap = e->spancap ? e->spancap * 2 : 16;
+         e->spans = realloc(e->spans, sizeof(int) * e->spancap);
+         if (e->spans == NULL) die("realloc");
       }
+      for (; cx < to; cx++) {
+         if (cx == from) e->spans[e->nspans * 2] = rx;
+         if (editor_row_char(row, cx) == '\t') rx += E.tab_stop - rx % E.tab_stop;
+         else rx++;
+      }
+      e->spans[e->nspans * 2 + 1] = rx;
+      e->nspans++;
    }
-   editor_force_quit();
+   return e;
 }
 
-void editor_open(char * filename)
+/* picks up what the workers have found. the first match is gone to as
+ * soon as there is one, and the count on the status bar kept current */
+void editor_search_poll()
 {
-   free(E.filename);
-   E.filename = strdup(filename);
-
-   editor_select_syntax_highlight();
-
-   FILE *fp = fopen(filename, "r");
-   if (!fp) die ("fopen");
-
-   char *line = NULL;
-   size_t linecap = 0;
-   ssize_t linelen;
-   while ((linelen = getline(&line, &linecap, fp)) != -1) {
-      while (linelen > 0 && (line[linelen - 1] == '\n' ||
-                            line[linelen - 1] == '\r'))
-         linelen--;
-      editor_insert_row(E.numrows, line, linelen);
+   struct search_state * st = &E.search;
+   if (st->row_job.active) {
+      // a long row's matches are drawn once they're in
+      if (__atomic_load_n(&st->row_job.done, __ATOMIC_ACQUIRE)) editor_refresh_screen();
+      else editor_timer_set(editor_search_poll, SEARCH_POLL_MS);
+      return;
    }
-   free(line);
-   fclose(fp);
-   E.dirty = 0;
+   if (!st->running) return;
+   if (editor_search_merge()) {
+      if (st->current == -1 && st->nmatches > 0) editor_search_goto(0);
+      editor_refresh_screen();
+   } else if (!st->running) {
+      editor_refresh_screen();
+   }
+   if (st->running) editor_timer_set(editor_search_poll, SEARCH_POLL_MS);
 }
 
-char * editor_prompt(char * prompt, void (*callback)(char *, int))
+// the search is over, but the query stays highlighted
+void editor_search_keep()
 {
-   size_t bufsize = 128;
-   char * buf = malloc(bufsize);
-
-   size_t buflen = 0;
-   buf[0] = '\0';
-
-   for(;;) {
-      editor_set_status_message(prompt, buf);
-      editor_refresh_screen();
-
-      int c = editor_read_key();
-      if (c == DEL_KEY || c == CTRL_KEY('h') || c == BACKSPACE) {
-         if (buflen != 0) buf[--buflen] = '\0';
-      } else if (c == '\x1b') {
-         editor_set_status_message("");
-         free(buf);
-         return NULL;
-      } else if (c == '\r') {
-         if (buflen != 0) {
-            editor_set_status_message("");
-            if (callback) callback(buf, c);
-            return buf;
-         }
-      } else if (!iscntrl(c) && c < 128) {
-         if (buflen == bufsize - 1) {
-            bufsize *= 2;
-            buf = realloc(buf, bufsize);
-         }
-         buf[buflen++] = c;
-         buf[buflen] = '\0';
-      }
+   struct search_state * st = &E.search;
+   editor_search_stop();
+   free(st->matches);
+   st->matches = NULL;
+   st->nmatches = st->cap = 0;
+   st->current = -1;
+   st->kept = 1;
+}
 
-      if (callback) callback(buf, c);
-   }
+void editor_search_reset()
+{
+   struct search_state * st = &E.search;
+   editor_search_keep();
+   free(st->query);
+   st->query = NULL;
+   st->qlen = 0;
+   st->kept = 0;
+   st->gen++;
+   editor_search_regex_free();
 }
 
-void editor_save()
+/* starts finding query, compiled first in regex mode. a literal one
+ * that extends the last query, once that was searched for in full, only
+ * looks again where the last one was found. the work is cut into chunks
+ * that a worker per core takes in turn; a single chunk of a small
+ * buffer is just searched here. returns whether query is new */
+int editor_search_update(const char * query)
 {
-   if (E.filename == NULL) {
-      E.filename = editor_prompt("Save as: %s (ESC to cancel)", NULL);
-      if (E.filename == NULL) {
-         editor_set_status_message("Save aborted");
-         return;
-      }
-      editor_select_syntax_highlight();
+   struct search_state * st = &E.search;
+   int m = strlen(query);
+   if (st->query && m == st->qlen && memcmp(query, st->query, m) == 0) return 0;
+   int narrow = !E.search_regex && st->query && !st->running && st->qlen > 0 &&
+         m > st->qlen && memcmp(query, st->query, st->qlen) == 0;
+
+   editor_search_stop();
+   free(st->query);
+   st->query = strdup(query);
+   st->qlen = m;
+   st->current = -1;
+   st->gen++;
+   editor_search_regex_free();
+   if (E.search_regex && m > 0) st->re = regex_new(query, &st->error);
+
+   int total;
+   if (narrow) {
+      st->prev = st->matches;
+      total = st->nmatches;
+      st->matches = NULL;
+      st->cap = 0;
+   } else {
+      total = m > 0 && !st->error ? E.numrows : 0;
+   }
+   st->nmatches = 0;
+   if (total == 0) {
+      free(st->prev);
+      st->prev = NULL;
+      return 1;
    }
 
-   int len;
-   char * buf = editor_rows_to_string(&len);
-
-   int fd = open(E.filename, O_RDWR | O_CREAT, 0644);
-   if (fd != -1) {
-      if (ftruncate(fd, len) != -1) {
-         if (write(fd, buf, len) == len) {
-            close(fd);
-            free(buf);
-            E.dirty = 0;
-            editor_set_status_message("%d bytes written to disk", len);
-            return;
-         }
-      }
-   close(fd);
+   st->nchunks = (total + SEARCH_CHUNK_ROWS - 1) / SEARCH_CHUNK_ROWS;
+   st->chunks = calloc(st->nchunks, sizeof(struct search_chunk));
+   if (st->chunks == NULL) die("calloc");
+   for (int c = 0; c < st->nchunks; c++) {
+      st->chunks[c].from = c * SEARCH_CHUNK_ROWS;
+      st->chunks[c].to = c == st->nchunks - 1 ? total : (c + 1) * SEARCH_CHUNK_ROWS;
+   }
+   st->merged = 0;
+   st->next_chunk = 0;
+   st->cancel = 0;
+   st->running = 1;
+
+   // a small buffer is searched right here, unless it's for a regex:
+   // one long line can take a while to match. few rows can still be
+   // a lot of bytes, so it's the size that's looked at
+   if (st->nchunks == 1 && st->re == NULL && row_tree_offset(E.numrows) <= SEARCH_INLINE_MAX) {
+      search_worker(st);
+      editor_search_merge();
+      return 1;
    }
 
-   free(buf);
-   editor_set_status_message("Can't save! I/O error: %s", strerror(errno));
+   int cpus = editor_cpus();
+   st->nthreads = cpus < st->nchunks ? cpus : st->nchunks;
+   st->threads = malloc(sizeof(pthread_t) * st->nthreads);
+   if (st->threads == NULL) die("malloc");
+   int started = 0;
+   for (int t = 0; t < st->nthreads; t++) {
+      if (pthread_create(&st->threads[started], NULL, search_worker, st) == 0) started++;
+   }
+   st->nthreads = started;
+   // without any workers, it's all done here
+   if (started == 0) search_worker(st);
+   editor_search_merge();
+   if (st->running) editor_timer_set(editor_search_poll, SEARCH_POLL_MS);
+   return 1;
 }
 
 void editor_find_callback(char * query, int key)
 {
-   static int last_match = -1;
-   static int direction = 1;
-
-   static int saved_hl_line;
-   static char * saved_hl = NULL;
-
-   if (saved_hl) {
-      memcpy(E.row[saved_hl_line].hl, saved_hl, E.row[saved_hl_line].rsize);
-      free(saved_hl);
-      saved_hl = NULL;
-   }
-
-   if (key == '\r' || key == '\x1b') {
-      last_match = -1;
-      direction = 1;
+   struct search_state * st = &E.search;
+   if (key == '\r' || key == '\x1b') return;
+
+   if (key == ARROW_RIGHT || key == ARROW_DOWN || key == ARROW_LEFT || key == ARROW_UP) {
+      // the next (or previous) match, wrapping around the ends of the
+      // buffer once they're known
+      editor_search_merge();
+      if (st->nmatches == 0) return;
+      int direction = key == ARROW_RIGHT || key == ARROW_DOWN ? 1 : -1;
+      int idx = st->current + direction;
+      if (idx >= st->nmatches) idx = st->running ? st->nmatches - 1 : 0;
+      if (idx < 0) idx = st->running ? 0 : st->nmatches - 1;
+      editor_search_goto(idx);
       return;
-   } else if (key == ARROW_RIGHT || key == ARROW_DOWN) {
-      direction = 1;
-   } else if (key == ARROW_LEFT || key == ARROW_UP) {
-      direction = -1;
-   } else {
-      last_match = -1;
-      direction = 1;
-   }
-   
-   if (last_match == -1) direction = 1;
-   int current = last_match;
-
-   int i;
-   for (i = 0; i < E.numrows; i++) {
-      current += direction;
-      if (current == -1) current = E.numrows - 1;
-      else if (current == E.numrows) current = 0;
-
-      erow * row = &E.row[current];
-      char * match = strstr(row->render, query);
-      if (match) {
-         last_match = current;
-         E.cy = current;
-         E.cx = editor_row_rx_to_cx(row, match - row->render);
-         E.rowoff = E.numrows;
-
-         saved_hl_line = current;
-         saved_hl = malloc(row->rsize);
-         memcpy(saved_hl, row->hl, row->rsize);
-         memset(&row->hl[match - row->render], HL_MATCH, strlen(query));
-         break;
-      }
    }
+
+   if (editor_search_update(query) && st->nmatches > 0) editor_search_goto(0);
 }
 
 void editor_find()
@@ -994,10 +5492,15 @@ void editor_find()
    int saved_coloff = E.coloff;
    int saved_rowoff = E.rowoff;
 
-   char * query = editor_prompt("Search: %s (ESC/Arrows/Enter)", editor_find_callback);
+   editor_search_reset();
+   char * query = editor_prompt(E.search_regex ? "Regex search: %s (ESC/Arrows/Enter)" :
+         "Search: %s (ESC/Arrows/Enter)", editor_find_callback);
 
-   if (query) free(query);
-   else {
+   if (query) {
+      editor_search_keep();
+      free(query);
+   } else {
+      editor_search_reset();
       E.cx = saved_cx;
       E.cy = saved_cy;
       E.coloff = saved_coloff;
@@ -1005,6 +5508,173 @@ void editor_find()
    }
 }
 
+/* takes the next field of a :s command, up to an unescaped delim, out of
+ * *p. \delim stands for delim; in the replacement (literal) \\ is a
+ * backslash, in the pattern other escapes are left for the regex */
+char * replace_field(char ** p, char delim, int literal)
+{
+   char * field = malloc(strlen(*p) + 1);
+   if (field == NULL) die("malloc");
+   int n = 0;
+   char * q = *p;
+   while (*q && *q != delim) {
+      if (q[0] == '\\' && (q[1] == delim || (literal && q[1] == '\\'))) q++;
+      else if (q[0] == '\\' && q[1]) field[n++] = *q++;
+      field[n++] = *q++;
+   }
+   field[n] = '\0';
+   if (*q == delim) q++;
+   *p = q;
+   return field;
+}
+
+/* where the pattern of a replace occurs in line s (n bytes): all of the
+ * places, or the first. found is left holding them */
+void replace_find(struct regex_matcher * rm, const char * pat, int m, int all,
+      const char * s, int n, struct search_chunk * found)
+{
+   found->nfound = 0;
+   if (rm) {
+      regex_search_line(rm, s, n, found, 0);
+      return;
+   }
+   int col = 0;
+   int k;
+   while (col <= n - m && (k = search_find(s + col, n - col, pat, m)) != -1) {
+      search_push(found, 0, col + k, m);
+      if (!all) break;
+      col += k + m;
+   }
+}
+
+/* :s/old/new/ replaces the first old in the cursor's row, :%s/old/new/ in
+ * every row, and a trailing g every old rather than the first. old is a
+ * regex in regex mode, and the last search if it's left empty. it's one
+ * pass over the rows: each row that changes is put together once, then
+ * set (and so highlighted again) once, and E.dirty goes up once. lazy
+ * leaves are only loaded if something in them changes. returns 0 if cmd
+ * isn't a replace at all (a plain s still saves) */
+int editor_replace(char * cmd)
+{
+   char * p = cmd;
+   int whole = *p == '%';
+   if (whole) p++;
+   if (p[0] != 's' || p[1] == '\0' || isalnum((unsigned char)p[1]) || isspace((unsigned char)p[1])) return 0;
+   char delim = p[1];
+   p += 2;
+
+   char * pat = replace_field(&p, delim, 0);
+   char * with = replace_field(&p, delim, 1);
+   int all = 0;
+   for (; *p; p++) {
+      if (*p == 'g') {
+         all = 1;
+      } else if (!isspace((unsigned char)*p)) {
+         editor_set_status_message("Unknown flag '%c'", *p);
+         goto done;
+      }
+   }
+   if (pat[0] == '\0' && E.search.query && E.search.qlen > 0) {
+      free(pat);
+      pat = strdup(E.search.query);
+   }
+   int m = strlen(pat);
+   if (m == 0) {
+      editor_set_status_message("Nothing to replace!");
+      goto done;
+   }
+
+   struct regex * re = NULL;
+   struct regex_matcher rm;
+   if (E.search_regex) {
+      const char * err;
+      re = regex_new(pat, &err);
+      if (re == NULL) {
+         editor_set_status_message("Bad regex: %s", err);
+         goto done;
+      }
+      regex_matcher_init(&rm, re);
+      rm.empty = 1;
+      rm.one = !all;
+   }
+
+   int from = whole ? 0 : E.cy;
+   int to = whole ? E.numrows : E.cy + 1;
+   if (to > E.numrows) to = E.numrows;
+   int wlen = strlen(with);
+   struct search_chunk found = { 0, 0, NULL, 0, 0, 0 };
+   struct abuf line = ABUF_INIT;
+   int count = 0, rows = 0;
+
+   int at = from;
+   while (at < to) {
+      int pos;
+      struct row_node * leaf = row_tree_locate(at, &pos);
+      int end = leaf->n;
+      if (end - pos > to - at) end = pos + to - at;
+
+      // a lazy leaf the literal pattern isn't in at all is passed over
+      if (leaf->lazy && !re && search_find(&E.map[leaf->u.offs[pos]],
+               leaf->u.offs[end] - leaf->u.offs[pos], pat, m) == -1) {
+         at += end - pos;
+         continue;
+      }
+
+      for (int i = pos; i < end; i++) {
+         int len;
+         const char * s;
+         if (leaf->lazy) {
+            s = editor_map_line(leaf->u.offs[i], leaf->u.offs[i + 1], &len);
+         } else {
+            s = editor_row_chars(&leaf->u.rows[i]);
+            len = leaf->u.rows[i].size;
+         }
+         replace_find(re ? &rm : NULL, pat, m, all, s, len, &found);
+         if (found.nfound == 0) continue;
+
+         line.len = 0;
+         int done = 0;
+         for (int k = 0; k < found.nfound; k++) {
+            ab_append(&line, s + done, found.found[k].col - done);
+            ab_append(&line, with, wlen);
+            done = found.found[k].col + found.found[k].len;
+         }
+         ab_append(&line, s + done, len - done);
+
+         // s points into the map, which loading the leaf leaves alone
+         leaf = row_leaf_load(leaf);
+         editor_row_set(&leaf->u.rows[i], at + i - pos, line.b, line.len);
+         count += found.nfound;
+         rows++;
+      }
+      at += end - pos;
+   }
+
+   free(line.b);
+   free(found.found);
+   if (re) {
+      regex_matcher_free(&rm);
+      regex_free(re);
+   }
+   if (count == 0) {
+      editor_set_status_message("Pattern not found: %s", pat);
+      goto done;
+   }
+
+   E.dirty++;
+   if (E.cy < E.numrows) {
+      int size = editor_row_at(E.cy)->size;
+      if (E.cx > size) E.cx = size;
+   }
+   editor_set_status_message("Replaced %d occurrence%s on %d line%s", count,
+         count == 1 ? "" : "s", rows, rows == 1 ? "" : "s");
+
+done:
+   free(pat);
+   free(with);
+   return 1;
+}
+
 void editor_command()
 {
    E.mode_previous = E.mode;
@@ -1015,6 +5685,8 @@ void editor_command()
 
    E.mode = E.mode_previous;
    if (query) {
+      if (editor_replace(query)) goto end;
+
       char * query_split = strtok(query, " ");
       char cmd[10][50];
       int num_args = 0; // includes command
@@ -1025,7 +5697,7 @@ void editor_command()
       }
 
       if (strcmp(cmd[0], "help") == 0) {
-         editor_set_status_message("Commands: help, tabstop, linenumbers, expandtab, write, quit");
+         editor_set_status_message("Commands: help, tabstop, linenumbers, expandtab, fsync, regex, noh, s, w, q");
       } else if (strcmp(cmd[0], "tabstop") == 0) {
          if (num_args < 2) {
             editor_set_status_message("Specify number of spaces in a tab!");
@@ -1040,7 +5712,13 @@ void editor_command()
             }
          }
 
+         if (atoi(cmd[1]) < 1) {
+            editor_set_status_message("Input a number!");
+            goto end;
+         }
+
          E.tab_stop = atoi(cmd[1]);
+         E.render_gen++;
          editor_set_status_message("Tab stop set to %c", cmd[1][0]);
       } else if (strcmp(cmd[0], "linenumbers") == 0) {
          if (num_args < 2 ||
@@ -1060,6 +5738,26 @@ void editor_command()
 
          E.tabs_as_spaces = strcmp(cmd[1], "true") == 0 ? 1 : 0;
          editor_set_status_message("Expand tab set to %s", cmd[1]);
+      } else if (strcmp(cmd[0], "fsync") == 0) {
+         if (num_args < 2 ||
+            (strcmp(cmd[1], "true") != 0 && strcmp(cmd[1], "false") != 0)) {
+            editor_set_status_message("Specify true/false");
+            goto end;
+         }
+
+         E.save_fsync = strcmp(cmd[1], "true") == 0 ? 1 : 0;
+         editor_set_status_message("Fsync on save set to %s", cmd[1]);
+      } else if (strcmp(cmd[0], "regex") == 0) {
+         if (num_args < 2 ||
+            (strcmp(cmd[1], "true") != 0 && strcmp(cmd[1], "false") != 0)) {
+            editor_set_status_message("Specify true/false");
+            goto end;
+         }
+
+         E.search_regex = strcmp(cmd[1], "true") == 0 ? 1 : 0;
+         editor_set_status_message("Regex search set to %s", cmd[1]);
+      } else if (strcmp(cmd[0], "nohighlight") == 0 || strcmp(cmd[0], "noh") == 0) {
+         editor_search_reset();
       } else if (strcmp(cmd[0], "quit") == 0 || strcmp(cmd[0], "q") == 0) {
          editor_quit(NULL);
       } else if (strcmp(cmd[0], "quit!") == 0 || strcmp(cmd[0], "q!") == 0) {
@@ -1091,14 +5789,14 @@ void editor_command()
 }
 
 void editor_move_cursor(int key) {
-   erow *row = (E.cy >= E.numrows) ? NULL : &E.row[E.cy];
+   erow *row = (E.cy >= E.numrows) ? NULL : editor_row_at(E.cy);
 
    switch (key) {
       case ARROW_LEFT:
          if (E.cx != 0) E.cx--;
          else if (E.cy > 0) {
             E.cy--;
-            E.cx = E.row[E.cy].size;
+            E.cx = editor_row_at(E.cy)->size;
          }
          break;
       case ARROW_RIGHT:
@@ -1116,13 +5814,41 @@ void editor_move_cursor(int key) {
          break;
    }
 
-   row = (E.cy >= E.numrows) ? NULL : &E.row[E.cy];
+   row = (E.cy >= E.numrows) ? NULL : editor_row_at(E.cy);
    int rowlen = row ? row->size : 0;
    if (E.cx > rowlen) {
       E.cx = rowlen;
    }
 }
 
+// moves the view by n rows, taking the cursor along if it would go off
+// screen
+void editor_scroll_view(int n)
+{
+   E.rowoff += n;
+   if (E.rowoff > E.numrows - 1) E.rowoff = E.numrows - 1;
+   if (E.rowoff < 0) E.rowoff = 0;
+
+   if (E.cy < E.rowoff) E.cy = E.rowoff;
+   if (E.cy >= E.rowoff + E.screenrows) E.cy = E.rowoff + E.screenrows - 1;
+   int rowlen = E.cy < E.numrows ? editor_row_at(E.cy)->size : 0;
+   if (E.cx > rowlen) E.cx = rowlen;
+}
+
+// puts the cursor on the character shown at screen column x, row y
+void editor_click(int x, int y)
+{
+   if (y < 0 || y >= E.screenrows) return;
+   E.cy = E.rowoff + y;
+   if (E.cy > E.numrows) E.cy = E.numrows;
+   E.cx = 0;
+   if (E.cy == E.numrows) return;
+
+   int rx = x + E.coloff;
+   if (E.show_line_numbers) rx -= num_digits(E.numrows) + LEFT_MARGIN_SIZE;
+   if (rx > 0) E.cx = editor_row_rx_to_cx(editor_row_at(E.cy), rx);
+}
+
 void editor_process_keypress() {
    int c = editor_read_key();
    static int quit_times = YAR_QUIT_TIMES;
@@ -1143,7 +5869,7 @@ void editor_process_keypress() {
          break;
       case END_KEY:
          if (E.cy < E.numrows)
-            E.cx = E.row[E.cy].size;
+            E.cx = editor_row_at(E.cy)->size;
          break;
 
       case CTRL_KEY('f'):
@@ -1231,6 +5957,21 @@ void editor_process_keypress() {
          }
          break;
       
+      case MOUSE_EVENT:
+         if (E.mouse.scroll) editor_scroll_view(E.mouse.scroll);
+         if (E.mouse.click) editor_click(E.mouse.x, E.mouse.y);
+         break;
+
+      case PASTE_START:
+         {
+            int len;
+            char * text = editor_read_paste(&len);
+            if (E.mode == MODE_EDITING) editor_insert_text(text, len);
+            free(text);
+         }
+         break;
+
+      case PASTE_STRAY_END:
       case CTRL_KEY('l'):
       /* case '\x1b': */
          break;
@@ -1253,13 +5994,84 @@ void init_editor() {
    E.rowoff = 0;
    E.coloff = 0;
    E.numrows = 0;
-   E.row = NULL;
+   E.rows = row_node_new(1);
+   E.map = NULL;
+   E.map_len = 0;
+   E.hl_valid = 0;
+   E.rcache = NULL;
+   E.rcache_tags = 0;
+   E.render_gen = 0;
+   E.frame = NULL;
+   E.shadow = NULL;
+   E.frame_odd = NULL;
+   E.shadow_odd = NULL;
+   // widths are asked in a UTF-8 locale whatever LC_CTYPE says, the way
+   // the terminal will draw the bytes
+   E.utf8 = newlocale(LC_CTYPE_MASK, "C.UTF-8", (locale_t)0);
+   if (E.utf8 == (locale_t)0) E.utf8 = newlocale(LC_CTYPE_MASK, "", (locale_t)0);
+   E.shadow_valid = 0;
+   E.shadow_rowoff = 0;
+   E.out.b = NULL;
+   E.out.len = 0;
+   E.out.cap = 0;
+   E.out_sent = 0;
+   E.redraw_pending = 0;
+   E.in_len = 0;
+   E.in_pos = 0;
+   memset(E.timers, 0, sizeof(E.timers));
+   memset(&E.mouse, 0, sizeof(E.mouse));
+   memset(&E.save, 0, sizeof(E.save));
+   E.save_from = 0;
+   E.disk_known = 0;
+   E.map_dev = 0;
+   E.map_ino = 0;
+   E.save_fsync = 1;
+   E.search_regex = 0;
+   memset(&E.journal, 0, sizeof(E.journal));
+   memset(&E.search, 0, sizeof(E.search));
+   E.search.current = -1;
+   E.search.gen = 1;
+   // loading a leaf waits on workers, so they mustn't be able to keep it
+   // out by taking turns at reading
+   pthread_rwlockattr_t lock_attr;
+   pthread_rwlockattr_init(&lock_attr);
+   pthread_rwlockattr_setkind_np(&lock_attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+   pthread_rwlock_init(&E.leaf_lock, &lock_attr);
+   pthread_rwlockattr_destroy(&lock_attr);
+   E.journal.fd = -1;
+   E.journal.last = -1;
+   E.hangup = 0;
+   E.map_lost = 0;
+   E.page_size = sysconf(_SC_PAGESIZE);
+
+   // a hangup wakes the event loop, which saves the journal and exits
+   struct sigaction sa;
+   memset(&sa, 0, sizeof(sa));
+   sa.sa_handler = editor_on_hangup;
+   sigemptyset(&sa.sa_mask);
+   sigaction(SIGHUP, &sa, NULL);
+   sigaction(SIGTERM, &sa, NULL);
+
+   sa.sa_handler = NULL;
+   sa.sa_sigaction = editor_on_bus;
+   sa.sa_flags = SA_SIGINFO;
+   sigaction(SIGBUS, &sa, NULL);
+
+   // frames go out through a description of the terminal of their own,
+   // opened non-blocking, so stdin's own flags are left alone
+   char * tty = ttyname(STDOUT_FILENO);
+   E.out_fd = tty ? open(tty, O_WRONLY | O_NONBLOCK | O_NOCTTY) : -1;
+   if (E.out_fd == -1) E.out_fd = STDOUT_FILENO;
+
    E.mode = MODE_READING;
    E.dirty = 0;
    E.filename = NULL;
    E.statusmsg[0] = '\0';
    E.statusmsg_time = 0;
    E.syntax = NULL;
+   E.syntaxes = NULL;
+   E.num_syntaxes = 0;
+   E.syntaxes_loaded = 0;
 
    if (get_window_size(&E.screenrows, &E.screencols) == -1) die("get_window_size");
    E.screenrows -= 2;
@@ -1277,9 +6089,14 @@ int main(int argc, char *argv[]) {
       editor_open(argv[1]);
    }
 
+   // keys that arrive together are all handled before the next frame
    for (;;) {
+      editor_check_map();
       editor_refresh_screen();
-      editor_process_keypress();
+      do {
+         editor_process_keypress();
+         editor_scroll();
+      } while (editor_key_pending());
    }
 
    return 0;